@@ -1,32 +1,80 @@
+/* For clock_gettime() when compiling as plain C */
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include "hshg.h"
 
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <time.h>
 
 #include <shnet/error.h>
 
-static void hshg_create_grid(struct hshg* const hshg) {
-  ++hshg->grids_len;
-  hshg->grids = shnet_realloc(hshg->grids, sizeof(*hshg->grids) * hshg->grids_len);
-  assert(hshg->grids);
-  struct hshg_grid* const current = hshg->grids + hshg->grids_len - 1;
-  struct hshg_grid* const past = hshg->grids + hshg->grids_len - 2;
-  current->cells_side = past->cells_side >> hshg->cell_div_log;
-  current->cells_log = past->cells_log - hshg->cell_div_log;
-  current->cells_mask = current->cells_side - 1;
-  current->cell_size = past->cell_size << hshg->cell_div_log;
-  current->inverse_cell_size = past->inverse_cell_size / (UINT32_C(1) << hshg->cell_div_log);
-  current->cells = shnet_calloc((hshg_cell_sq_t) current->cells_side * current->cells_side, sizeof(*current->cells));
-  assert(current->cells);
+#ifdef HSHG_THREADS
+#include <pthread.h>
+#endif
+
+#if (defined(HSHG_MORTON) && defined(__BMI2__)) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#ifdef HSHG_UPDATE
+#define hshg_call_update(hshg, idx) HSHG_UPDATE(hshg, idx)
+#else
+#define hshg_call_update(hshg, idx) (hshg)->update(hshg, idx)
+#endif
+
+#ifdef HSHG_COLLIDE
+#define hshg_has_collide(hshg) 1
+#define hshg_call_collide(hshg, a, b) HSHG_COLLIDE(hshg, a, b)
+#else
+#define hshg_has_collide(hshg) ((hshg)->collide != NULL)
+#define hshg_call_collide(hshg, a, b) (hshg)->collide(hshg, a, b)
+#endif
+
+#ifdef HSHG_QUERY
+#define hshg_call_query(hshg, entity) HSHG_QUERY(hshg, entity)
+#else
+#define hshg_call_query(hshg, entity) (hshg)->query(hshg, entity)
+#endif
+
+#ifdef HSHG_FIXED
+#define hshg_abs(x) ((x) < 0 ? -(x) : (x))
+#define hshg_half(x) ((x) >> 1)
+#else
+#define hshg_abs(x) fabsf(x)
+#define hshg_half(x) ((x) * 0.5f)
+#endif
+
+static void hshg_free_grids(struct hshg* const hshg) {
+  for(uint8_t i = 0; i < hshg->grids_size; ++i) {
+    free(hshg->grids[i].used_cells);
+  }
+  free(hshg->grids);
+  free(hshg->cells);
+  free(hshg->counts);
+  free(hshg->bitmap);
+  free(hshg->used_idx);
 }
 
 int hshg_init(struct hshg* const hshg, const hshg_cell_t side, const uint32_t size) {
   assert(__builtin_popcount(side) == 1);
   assert(size > 0);
+  /* grid_size must not wrap */
+  assert((uint64_t) side * size <= UINT32_MAX);
+#ifdef HSHG_FIXED
+  assert(__builtin_popcount(size) == 1);
+#endif
+  assert(hshg->loose >= 0 && hshg->loose < 0.5f);
   if(hshg->cell_div_log == 0) {
     hshg->cell_div_log = 1;
   }
+  if(hshg->crowded == 0) {
+    hshg->crowded = 32;
+  }
   hshg->entities_used = 1;
   if(hshg->entities_size == 0) {
     hshg->entities_size = 1;
@@ -36,28 +84,86 @@ int hshg_init(struct hshg* const hshg, const hshg_cell_t side, const uint32_t si
       return -1;
     }
   }
-  hshg->grids = shnet_malloc(sizeof(*hshg->grids));
+  /* All grids that can ever be created are allocated upfront as one pyramid,
+  down to the first one with 2x2 cells or less, coarsest grid first. The
+  upward walk in hshg_collide() then stays in one small region of memory
+  right before the first grid, and creating a grid is only a matter of
+  bumping grids_len. */
+  hshg->grids_size = 1;
+  hshg_cell_sq_t cells_len = (hshg_cell_sq_t) side * side;
+  hshg_cell_sq_t bitmap_len = (cells_len + 63) >> 6;
+  for(hshg_cell_t cur = side; cur > 2;) {
+    cur >>= hshg->cell_div_log;
+    ++hshg->grids_size;
+    cells_len += (hshg_cell_sq_t) cur * cur;
+    bitmap_len += ((hshg_cell_sq_t) cur * cur + 63) >> 6;
+  }
+  hshg->grids = shnet_calloc(hshg->grids_size, sizeof(*hshg->grids));
   if(hshg->grids == NULL) {
     free(hshg->entities);
     return -1;
   }
-  hshg->grids_len = 1;
-  hshg->grids->cells = shnet_calloc((hshg_cell_sq_t) side * side, sizeof(*hshg->grids->cells));
-  if(hshg->grids->cells == NULL) {
+  hshg->cells = shnet_calloc(cells_len, sizeof(*hshg->cells));
+  hshg->counts = shnet_calloc(cells_len, sizeof(*hshg->counts));
+  hshg->bitmap = shnet_calloc(bitmap_len, sizeof(*hshg->bitmap));
+  hshg->used_idx = shnet_malloc(sizeof(*hshg->used_idx) * cells_len);
+  if(hshg->cells == NULL || hshg->counts == NULL || hshg->bitmap == NULL || hshg->used_idx == NULL) {
+    hshg_free_grids(hshg);
     free(hshg->entities);
-    free(hshg->grids);
     return -1;
   }
-  hshg->grids->cells_side = side;
-  hshg->grids->cells_log = __builtin_ctz(side);
-  hshg->grids->cells_mask = side - 1;
-  hshg->grids->cell_size = size;
-  hshg->grids->inverse_cell_size = 1.0f / size;
+  for(uint8_t i = 0; i < hshg->grids_size; ++i) {
+    struct hshg_grid* const grid = hshg->grids + i;
+    grid->cells_side = side >> (hshg->cell_div_log * i);
+    grid->cells_log = __builtin_ctz(side) - hshg->cell_div_log * i;
+    grid->cells_mask = grid->cells_side - 1;
+    grid->cell_size = size << (hshg->cell_div_log * i);
+#ifdef HSHG_FIXED
+    grid->cell_size_log = __builtin_ctz(grid->cell_size);
+    /* Scaled from the first grid, so that every grid rounds it the same */
+    grid->margin = (hshg_pos_t)(hshg->loose * size) << (hshg->cell_div_log * i);
+#else
+    grid->inverse_cell_size = 1.0f / grid->cell_size;
+    grid->margin = hshg->loose * grid->cell_size;
+#endif
+    const hshg_cell_sq_t sq = (hshg_cell_sq_t) grid->cells_side * grid->cells_side;
+    cells_len -= sq;
+    bitmap_len -= (sq + 63) >> 6;
+    grid->cells = hshg->cells + cells_len;
+    grid->counts = hshg->counts + cells_len;
+    grid->bitmap = hshg->bitmap + bitmap_len;
+    grid->used_idx = hshg->used_idx + cells_len;
+    grid->used_cells = shnet_malloc(sizeof(*grid->used_cells));
+    if(grid->used_cells == NULL) {
+      hshg_free_grids(hshg);
+      free(hshg->entities);
+      return -1;
+    }
+    grid->used = 0;
+    grid->used_size = 1;
+    grid->entities_len = 0;
+  }
+  hshg->grids_len = 1;
+  hshg->giants = 0;
+#ifdef HSHG_VELOCITY
+  hshg->toi = 1;
+#endif
+  hshg->contiguous = 0;
+  hshg->pairs_valid = 0;
+  hshg->pairs_len = 0;
+  hshg->pairs_size = 0;
+  hshg->sweep_size = 0;
+  hshg->moved_size = 0;
+  hshg->bounds_size = 0;
   
   hshg->cell_log = 31 - __builtin_ctz(size);
 
   hshg->grid_size = (hshg_cell_sq_t) side * size;
+#ifdef HSHG_FIXED
+  hshg->grid_size_log = __builtin_ctz(hshg->grid_size);
+#else
   hshg->inverse_grid_size = 1.0f / hshg->grid_size;
+#endif
   return 0;
 }
 
@@ -68,12 +174,35 @@ void hshg_free(struct hshg* const hshg) {
   hshg->entities_size = 0;
   hshg->free_entity = 0;
   
-  for(uint8_t i = 0; i < hshg->grids_len; ++i) {
-    free(hshg->grids[i].cells);
-  }
-  free(hshg->grids);
+  hshg_free_grids(hshg);
   hshg->grids = NULL;
+  hshg->cells = NULL;
+  hshg->counts = NULL;
+  hshg->bitmap = NULL;
+  hshg->used_idx = NULL;
   hshg->grids_len = 0;
+  hshg->grids_size = 0;
+  hshg->giants = 0;
+  
+  free(hshg->pairs);
+  free(hshg->pairs_pos);
+  hshg->pairs = NULL;
+  hshg->pairs_pos = NULL;
+  hshg->pairs_valid = 0;
+  hshg->pairs_len = 0;
+  hshg->pairs_size = 0;
+  
+  free(hshg->sweep);
+  hshg->sweep = NULL;
+  hshg->sweep_size = 0;
+  
+  free(hshg->moved);
+  hshg->moved = NULL;
+  hshg->moved_size = 0;
+  
+  free(hshg->bounds);
+  hshg->bounds = NULL;
+  hshg->bounds_size = 0;
 }
 
 static hshg_entity_t hshg_get_entity(struct hshg* const hshg) {
@@ -97,8 +226,41 @@ static void hshg_return_entity(struct hshg* const hshg, const hshg_entity_t idx)
   hshg->free_entity = idx;
 }
 
+static void grid_set_used(struct hshg_grid* const grid, const hshg_cell_sq_t cell) {
+  if(grid->used == grid->used_size) {
+    grid->used_size <<= 1;
+    grid->used_cells = shnet_realloc(grid->used_cells, sizeof(*grid->used_cells) * grid->used_size);
+    assert(grid->used_cells);
+  }
+  grid->used_idx[cell] = grid->used;
+  grid->used_cells[grid->used++] = cell;
+  grid->bitmap[cell >> 6] |= UINT64_C(1) << (cell & 63);
+}
+
+static void grid_set_unused(struct hshg_grid* const grid, const hshg_cell_sq_t cell) {
+  const hshg_cell_sq_t last = grid->used_cells[--grid->used];
+  grid->used_cells[grid->used_idx[cell]] = last;
+  grid->used_idx[last] = grid->used_idx[cell];
+  grid->bitmap[cell >> 6] &= ~(UINT64_C(1) << (cell & 63));
+}
+
+/* The bitmap is 32 times smaller than the cells array, so unlike the cells,
+it mostly stays in cache. Test it before touching a cell that can be empty. */
+static int grid_is_used(const struct hshg_grid* const grid, const hshg_cell_sq_t cell) {
+  return (grid->bitmap[cell >> 6] >> (cell & 63)) & 1;
+}
+
+/* The cell of x on an unfolded grid */
+static hshg_cell_t grid_pos_cell(const struct hshg_grid* const grid, const hshg_pos_t x) {
+#ifdef HSHG_FIXED
+  return (x < 0 ? -(uint32_t) x : (uint32_t) x) >> grid->cell_size_log;
+#else
+  return fabsf(x) * grid->inverse_cell_size;
+#endif
+}
+
 static hshg_cell_t grid_get_cell_(const struct hshg_grid* const grid, const hshg_pos_t x) {
-  const hshg_cell_t cell = fabsf(x) * grid->inverse_cell_size;
+  const hshg_cell_t cell = grid_pos_cell(grid, x);
   if(cell & grid->cells_side) {
     return grid->cells_mask - (cell & grid->cells_mask);
   } else {
@@ -106,165 +268,1162 @@ static hshg_cell_t grid_get_cell_(const struct hshg_grid* const grid, const hshg
   }
 }
 
+#ifdef HSHG_MORTON
+
+static hshg_cell_sq_t morton_spread(const hshg_cell_t x) {
+#ifdef __BMI2__
+  return _pdep_u64(x, UINT64_C(0x5555555555555555));
+#else
+  uint64_t v = x;
+  v = (v | (v << 16)) & UINT64_C(0x0000FFFF0000FFFF);
+  v = (v | (v << 8)) & UINT64_C(0x00FF00FF00FF00FF);
+  v = (v | (v << 4)) & UINT64_C(0x0F0F0F0F0F0F0F0F);
+  v = (v | (v << 2)) & UINT64_C(0x3333333333333333);
+  v = (v | (v << 1)) & UINT64_C(0x5555555555555555);
+  return v;
+#endif
+}
+
+static hshg_cell_t morton_compact(const hshg_cell_sq_t x) {
+#ifdef __BMI2__
+  return _pext_u64(x, UINT64_C(0x5555555555555555));
+#else
+  uint64_t v = x & UINT64_C(0x5555555555555555);
+  v = (v | (v >> 1)) & UINT64_C(0x3333333333333333);
+  v = (v | (v >> 2)) & UINT64_C(0x0F0F0F0F0F0F0F0F);
+  v = (v | (v >> 4)) & UINT64_C(0x00FF00FF00FF00FF);
+  v = (v | (v >> 8)) & UINT64_C(0x0000FFFF0000FFFF);
+  v = (v | (v >> 16)) & UINT64_C(0x00000000FFFFFFFF);
+  return v;
+#endif
+}
+
+#endif // HSHG_MORTON
+
+/* With HSHG_MORTON, cells are laid out in Z-order, so that all 8 neighbours
+of a cell are usually on the same or the next few cache lines, instead of
+cells_side cells away like with rows. Everything that goes through cells in
+order of their index, like hshg_optimize(), follows the curve as well. */
+static hshg_cell_sq_t grid_cell(const struct hshg_grid* const grid, const hshg_cell_t x, const hshg_cell_t y) {
+#ifdef HSHG_MORTON
+  (void) grid;
+  return morton_spread(x) | (morton_spread(y) << 1);
+#else
+  return (hshg_cell_sq_t) x | ((hshg_cell_sq_t) y << grid->cells_log);
+#endif
+}
+
+static hshg_cell_t grid_cell_x(const struct hshg_grid* const grid, const hshg_cell_sq_t cell) {
+#ifdef HSHG_MORTON
+  (void) grid;
+  return morton_compact(cell);
+#else
+  return cell & grid->cells_mask;
+#endif
+}
+
+static hshg_cell_t grid_cell_y(const struct hshg_grid* const grid, const hshg_cell_sq_t cell) {
+#ifdef HSHG_MORTON
+  (void) grid;
+  return morton_compact(cell >> 1);
+#else
+  return cell >> grid->cells_log;
+#endif
+}
+
 static hshg_cell_sq_t grid_get_cell(const struct hshg_grid* const grid, const hshg_pos_t x, const hshg_pos_t y) {
-  return (hshg_cell_sq_t) grid_get_cell_(grid, x) | ((hshg_cell_sq_t) grid_get_cell_(grid, y) << grid->cells_log);
+  return grid_cell(grid, grid_get_cell_(grid, x), grid_get_cell_(grid, y));
 }
 
-static uint8_t hshg_get_grid(const struct hshg* const hshg, const hshg_pos_t r) {
-  const uint32_t rounded = r + r;
+/* Entities go on the grid fitting their larger extent */
+static uint8_t hshg_get_grid(const struct hshg* const hshg, const hshg_pos_t _r) {
+  /* Pairs up to a skin apart must be found too, so that they can be reused */
+  const hshg_pos_t r = _r + hshg_half(hshg->skin);
+#ifdef HSHG_FIXED
+  const uint64_t cell_size = hshg->grids[0].cell_size;
+  const uint64_t scaled = ((uint64_t) r + r) * cell_size / (cell_size - 2 * hshg->grids[0].margin);
+  const uint32_t rounded = scaled > UINT32_MAX ? UINT32_MAX : scaled;
+#else
+  const uint32_t rounded = hshg->loose != 0 ? (r + r) / (1 - 2 * hshg->loose) : r + r;
+#endif
   if(rounded < hshg->grids[0].cell_size) {
     return 0;
   }
   return (hshg->cell_log - __builtin_clz(rounded)) / hshg->cell_div_log + 1;
 }
 
-static uint8_t hshg_get_grid_resizable(struct hshg* const hshg, const hshg_pos_t r) {
-  uint8_t grid = hshg_get_grid(hshg, r);
+#ifdef HSHG_VELOCITY
+static int hshg_is_fast(const struct hshg* const hshg, const struct hshg_entity* const entity) {
+  return hshg->ccd && (hshg_abs(entity->vx) > entity->w + entity->w || hshg_abs(entity->vy) > entity->h + entity->h);
+}
+#endif // HSHG_VELOCITY
+
+/* Entities larger than the cells of the topmost grid would collide with
+everything on the folded plane, so they are kept out of the grids. So are
+fast entities, which have to be swept. */
+static uint8_t hshg_get_grid_resizable(struct hshg* const hshg, const struct hshg_entity* const entity) {
+#ifdef HSHG_VELOCITY
+  if(hshg_is_fast(hshg, entity)) {
+    return hshg_grid_giant;
+  }
+#endif
+  const uint8_t grid = hshg_get_grid(hshg, entity->w > entity->h ? entity->w : entity->h);
+  if(grid >= hshg->grids_size) {
+    return hshg_grid_giant;
+  }
   if(grid >= hshg->grids_len) {
-    for(uint8_t i = hshg->grids_len; i <= grid && hshg->grids[hshg->grids_len - 1].cells_side > 2; ++i) {
-      hshg_create_grid(hshg);
-    }
-    grid = hshg->grids_len - 1;
+    hshg->grids_len = grid + 1;
   }
   return grid;
 }
 
-static void hshg_reinsert(const struct hshg* const hshg, const hshg_entity_t idx) {
+static void hshg_link(struct hshg* const hshg, const hshg_entity_t idx) {
   struct hshg_entity* const ent = hshg->entities + idx;
-  ent->cell = grid_get_cell(hshg->grids + ent->grid, ent->x, ent->y);
-  ent->next = hshg->grids[ent->grid].cells[ent->cell];
+  struct hshg_grid* const grid = hshg->grids + ent->grid;
+  hshg->contiguous = 0;
+  ++grid->counts[ent->cell];
+  ent->next = grid->cells[ent->cell];
   if(ent->next != 0) {
     hshg->entities[ent->next].prev = idx;
+  } else {
+    grid_set_used(grid, ent->cell);
   }
   ent->prev = 0;
-  hshg->grids[ent->grid].cells[ent->cell] = idx;
+  grid->cells[ent->cell] = idx;
+}
+
+static void hshg_link_giant(struct hshg* const hshg, const hshg_entity_t idx) {
+  struct hshg_entity* const ent = hshg->entities + idx;
+  ent->next = hshg->giants;
+  hshg->entities[ent->next].prev = idx;
+  ent->prev = 0;
+  hshg->giants = idx;
+}
+
+static void hshg_reinsert(struct hshg* const hshg, const hshg_entity_t idx) {
+  struct hshg_entity* const ent = hshg->entities + idx;
+  if(ent->grid == hshg_grid_giant) {
+    ent->cell = 0;
+    hshg_link_giant(hshg, idx);
+    return;
+  }
+  ent->cell = grid_get_cell(hshg->grids + ent->grid, ent->x, ent->y);
+  ++hshg->grids[ent->grid].entities_len;
+  hshg_link(hshg, idx);
 }
 
 void hshg_insert(struct hshg* const hshg, const struct hshg_entity* const entity) {
+  hshg->pairs_valid = 0;
   const hshg_entity_t idx = hshg_get_entity(hshg);
   struct hshg_entity* const ent = hshg->entities + idx;
-  ent->grid = hshg_get_grid_resizable(hshg, entity->r);
+  ent->grid = hshg_get_grid_resizable(hshg, entity);
   ent->ref = entity->ref;
   ent->x = entity->x;
   ent->y = entity->y;
-  ent->r = entity->r;
+  ent->w = entity->w;
+  ent->h = entity->h;
+#ifdef HSHG_VELOCITY
+  ent->vx = entity->vx;
+  ent->vy = entity->vy;
+#endif
+#if defined(hshg_payload_t)
+  ent->payload = entity->payload;
+#elif defined(HSHG_PAYLOAD)
+  memcpy(ent->payload, entity->payload, HSHG_PAYLOAD);
+#endif
   hshg_reinsert(hshg, idx);
 }
 
-static void hshg_remove_light(const struct hshg* const hshg, const hshg_entity_t idx) {
+static void hshg_remove_light(struct hshg* const hshg, const hshg_entity_t idx) {
   struct hshg_entity* const entity = hshg->entities + idx;
+  if(entity->grid == hshg_grid_giant) {
+    if(entity->prev == 0) {
+      hshg->giants = entity->next;
+    } else {
+      hshg->entities[entity->prev].next = entity->next;
+    }
+    hshg->entities[entity->next].prev = entity->prev;
+    return;
+  }
+  hshg->contiguous = 0;
+  --hshg->grids[entity->grid].counts[entity->cell];
   if(entity->prev == 0) {
-    hshg->grids[entity->grid].cells[entity->cell] = entity->next;
+    struct hshg_grid* const grid = hshg->grids + entity->grid;
+    grid->cells[entity->cell] = entity->next;
+    if(entity->next == 0) {
+      grid_set_unused(grid, entity->cell);
+    }
   } else {
     hshg->entities[entity->prev].next = entity->next;
   }
   hshg->entities[entity->next].prev = entity->prev;
 }
 
-void hshg_remove(struct hshg* const hshg, const hshg_entity_t idx) {
+static void hshg_unlink(struct hshg* const hshg, const hshg_entity_t idx) {
   hshg_remove_light(hshg, idx);
+  if(hshg->entities[idx].grid != hshg_grid_giant) {
+    --hshg->grids[hshg->entities[idx].grid].entities_len;
+  }
+}
+
+void hshg_remove(struct hshg* const hshg, const hshg_entity_t idx) {
+  hshg->pairs_valid = 0;
+  hshg_unlink(hshg, idx);
   hshg_return_entity(hshg, idx);
 }
 
-void hshg_move(const struct hshg* const hshg, const hshg_entity_t idx) {
+void hshg_stage_insert(struct hshg_stage* const stage, const struct hshg_entity* const entity) {
+  if(stage->inserts_len == stage->inserts_size) {
+    stage->inserts_size = stage->inserts_size != 0 ? stage->inserts_size << 1 : 64;
+    stage->inserts = shnet_realloc(stage->inserts, sizeof(*stage->inserts) * stage->inserts_size);
+    assert(stage->inserts);
+  }
+  stage->inserts[stage->inserts_len++] = *entity;
+}
+
+void hshg_stage_remove(struct hshg_stage* const stage, const hshg_entity_t idx) {
+  if(stage->removes_len == stage->removes_size) {
+    stage->removes_size = stage->removes_size != 0 ? stage->removes_size << 1 : 64;
+    stage->removes = shnet_realloc(stage->removes, sizeof(*stage->removes) * stage->removes_size);
+    assert(stage->removes);
+  }
+  stage->removes[stage->removes_len++] = idx;
+}
+
+/* Applies and empties a number of stages, with no other thread touching
+them or the HSHG. All removals go first, so that none of them can hit an
+entity inserted by the same commit, and an entity removed by more than one
+thread is only removed once. Stages are applied in order, so the result
+only depends on what was staged, not on the timing of threads. */
+void hshg_commit(struct hshg* const hshg, struct hshg_stage* const stages, const uint32_t stages_len) {
+  for(uint32_t i = 0; i < stages_len; ++i) {
+    struct hshg_stage* const stage = stages + i;
+    for(hshg_entity_t j = 0; j < stage->removes_len; ++j) {
+      if(hshg->entities[stage->removes[j]].cell != hshg_cell_sq_max) {
+        hshg_remove(hshg, stage->removes[j]);
+      }
+    }
+    stage->removes_len = 0;
+  }
+  for(uint32_t i = 0; i < stages_len; ++i) {
+    struct hshg_stage* const stage = stages + i;
+    for(hshg_entity_t j = 0; j < stage->inserts_len; ++j) {
+      hshg_insert(hshg, stage->inserts + j);
+    }
+    stage->inserts_len = 0;
+  }
+}
+
+void hshg_stage_free(struct hshg_stage* const stage) {
+  free(stage->inserts);
+  free(stage->removes);
+  stage->inserts = NULL;
+  stage->removes = NULL;
+  stage->inserts_len = 0;
+  stage->inserts_size = 0;
+  stage->removes_len = 0;
+  stage->removes_size = 0;
+}
+
+static void hshg_regrid(struct hshg* const hshg, const hshg_entity_t idx) {
+  const uint8_t grid = hshg_get_grid_resizable(hshg, hshg->entities + idx);
+  if(hshg->entities[idx].grid != grid) {
+    hshg->pairs_valid = 0;
+    hshg_unlink(hshg, idx);
+    hshg->entities[idx].grid = grid;
+    hshg_reinsert(hshg, idx);
+  }
+}
+
+/* The cells that a range of 2 * margin can touch are the ones of its ends. */
+static int grid_cell_holds(const struct hshg_grid* const grid, const hshg_cell_t cell, const hshg_pos_t x) {
+  return grid_get_cell_(grid, x - grid->margin) == cell || grid_get_cell_(grid, x + grid->margin) == cell;
+}
+
+void hshg_move(struct hshg* const hshg, const hshg_entity_t idx) {
   struct hshg_entity* const entity = hshg->entities + idx;
+  if(hshg->pairs_valid) {
+    const hshg_pos_t* const pos = hshg->pairs_pos + ((uint64_t) idx << 1);
+    if(hshg_abs(entity->x - pos[0]) > hshg_half(hshg->skin) || hshg_abs(entity->y - pos[1]) > hshg_half(hshg->skin)) {
+      hshg->pairs_valid = 0;
+    }
+  }
+#ifdef HSHG_VELOCITY
+  if(hshg->ccd && hshg_is_fast(hshg, entity) != (entity->grid == hshg_grid_giant)) {
+    hshg_regrid(hshg, idx);
+    return;
+  }
+#endif
+  if(hshg->rebuild || entity->grid == hshg_grid_giant) return;
   const struct hshg_grid* const grid = hshg->grids + entity->grid;
+  if(grid->margin != 0 && grid_cell_holds(grid, grid_cell_x(grid, entity->cell), entity->x) && grid_cell_holds(grid, grid_cell_y(grid, entity->cell), entity->y)) {
+    return;
+  }
   const hshg_cell_sq_t cell = grid_get_cell(grid, entity->x, entity->y);
   if(entity->cell != cell) {
     hshg_remove_light(hshg, idx);
     entity->cell = cell;
-    entity->next = grid->cells[cell];
-    if(entity->next != 0) {
-      hshg->entities[entity->next].prev = idx;
-    }
-    entity->prev = 0;
-    grid->cells[cell] = idx;
+    hshg_link(hshg, idx);
   }
 }
 
 void hshg_resize(struct hshg* const hshg, const hshg_entity_t idx) {
-  const uint8_t grid = hshg_get_grid_resizable(hshg, hshg->entities[idx].r);
-  if(hshg->entities[idx].grid != grid) {
-    hshg_remove_light(hshg, idx);
-    hshg->entities[idx].grid = grid;
-    hshg_reinsert(hshg, idx);
-  }
+  hshg->pairs_valid = 0;
+  hshg_regrid(hshg, idx);
 }
 
 void hshg_update(struct hshg* const hshg) {
   for(hshg_entity_t i = 1; i < hshg->entities_used; ++i) {
     if(hshg->entities[i].cell == hshg_cell_sq_max) continue;
-    hshg->update(hshg, i);
+    hshg_call_update(hshg, i);
+  }
+  if(hshg->rebuild) {
+    hshg_rebuild(hshg);
+  }
+}
+
+#ifdef HSHG_VELOCITY
+
+/* A replacement for hshg_update() for entities that only move by vx and vy
+and bounce off the walls of the given rectangle, without calling anything
+per entity. Entities are moved first, and only then cells are compared in one
+go, so that only entities that left their cells are relinked. Bouncing turns
+the velocity towards the inside of the rectangle without changing its speed.
+Dead entities are moved too, which is harmless and keeps the first loop free
+of branches, so that it can be vectorised. */
+void hshg_integrate(struct hshg* const hshg, const hshg_pos_t x1, const hshg_pos_t y1, const hshg_pos_t x2, const hshg_pos_t y2) {
+  struct hshg_entity* const entities = hshg->entities;
+  const hshg_entity_t used = hshg->entities_used;
+  for(hshg_entity_t i = 1; i < used; ++i) {
+    struct hshg_entity* const entity = entities + i;
+    const hshg_pos_t vx = entity->vx;
+    const hshg_pos_t vy = entity->vy;
+    const hshg_pos_t x = entity->x + vx;
+    const hshg_pos_t y = entity->y + vy;
+    const hshg_pos_t w = entity->w;
+    const hshg_pos_t h = entity->h;
+    entity->x = x;
+    entity->y = y;
+    const hshg_pos_t bounce_x = x < x1 + w ? hshg_abs(vx) : vx;
+    const hshg_pos_t bounce_y = y < y1 + h ? hshg_abs(vy) : vy;
+    entity->vx = x + w >= x2 ? -hshg_abs(vx) : bounce_x;
+    entity->vy = y + h >= y2 ? -hshg_abs(vy) : bounce_y;
+  }
+  if(hshg->rebuild) {
+    /* Entities that sped up or slowed down still have to swap between the
+    grids and the swept giants before they are sorted */
+    if(hshg->ccd) {
+      for(hshg_entity_t i = 1; i < used; ++i) {
+        const struct hshg_entity* const entity = entities + i;
+        if(entity->cell == hshg_cell_sq_max) continue;
+        if(hshg_is_fast(hshg, entity) != (entity->grid == hshg_grid_giant)) {
+          hshg_regrid(hshg, i);
+        }
+      }
+    }
+    hshg_rebuild(hshg);
+    return;
+  }
+  /* These need to look at every entity anyway */
+  if(hshg->ccd || hshg->pairs_valid) {
+    for(hshg_entity_t i = 1; i < used; ++i) {
+      if(entities[i].cell == hshg_cell_sq_max) continue;
+      hshg_move(hshg, i);
+    }
+    return;
+  }
+  if(used > hshg->moved_size) {
+    hshg->moved_size = hshg->entities_size;
+    hshg->moved = shnet_realloc(hshg->moved, sizeof(*hshg->moved) * hshg->moved_size);
+    assert(hshg->moved);
+  }
+  hshg_entity_t moved = 0;
+  for(hshg_entity_t i = 1; i < used; ++i) {
+    const struct hshg_entity* const entity = entities + i;
+    /* Dead entities and giants are compared against the first grid and
+    thrown away after */
+    const int in_grid = entity->grid < hshg->grids_size && entity->cell != hshg_cell_sq_max;
+    const struct hshg_grid* const grid = hshg->grids + (in_grid ? entity->grid : 0);
+    hshg->moved[moved] = i;
+    moved += in_grid & (grid_get_cell(grid, entity->x, entity->y) != entity->cell);
+  }
+  for(hshg_entity_t i = 0; i < moved; ++i) {
+    hshg_move(hshg, hshg->moved[i]);
+  }
+}
+
+#endif // HSHG_VELOCITY
+
+static void hshg_collide_found(struct hshg* const hshg, const struct hshg_entity* const a, const struct hshg_entity* const b) {
+  if(hshg->skin != 0 || !hshg_has_collide(hshg)) {
+    if(hshg->pairs_len == hshg->pairs_size) {
+      hshg->pairs_size = hshg->pairs_size != 0 ? hshg->pairs_size << 1 : 64;
+      hshg->pairs = shnet_realloc(hshg->pairs, sizeof(*hshg->pairs) * hshg->pairs_size);
+      assert(hshg->pairs);
+    }
+    hshg->pairs[hshg->pairs_len].a = a - hshg->entities;
+    hshg->pairs[hshg->pairs_len].b = b - hshg->entities;
+    ++hshg->pairs_len;
+  }
+  if(hshg_has_collide(hshg)) {
+    hshg_call_collide(hshg, a, b);
+  }
+}
+
+/* Only pairs whose AABBs overlap are handed to the callback. With a skin,
+that is AABBs widened by it, so that the pairs can be remembered for later
+calls. */
+static void hshg_collide_pair(struct hshg* const hshg, const struct hshg_entity* const a, const struct hshg_entity* const b) {
+  if(hshg_abs(a->x - b->x) > a->w + b->w + hshg->skin || hshg_abs(a->y - b->y) > a->h + b->h + hshg->skin) return;
+  hshg_collide_found(hshg, a, b);
+}
+
+#ifdef HSHG_VELOCITY
+
+/* Two intervals that are d apart now and extend e together were d - v * s
+apart s frames ago. Narrows [lo, hi] down to when they overlapped. */
+static void hshg_sweep_axis(const float d, const float v, const float e, float* const lo, float* const hi) {
+  if(v == 0) {
+    if(fabsf(d) > e) {
+      *lo = 2;
+    }
+    return;
+  }
+  float s1 = (d - e) / v;
+  float s2 = (d + e) / v;
+  if(s1 > s2) {
+    const float temp = s1;
+    s1 = s2;
+    s2 = temp;
   }
+  if(s1 > *lo) *lo = s1;
+  if(s2 < *hi) *hi = s2;
 }
 
-void hshg_collide(const struct hshg* const hshg) {
+/* Pairs with a fast entity are checked along their movement over the last
+frame relative to each other, vx and vy. Entities in the grids are slow
+enough not to pass through anything, so they are taken as standing still. */
+static void hshg_collide_swept(struct hshg* const hshg, const struct hshg_entity* const a, const struct hshg_entity* const b, const hshg_pos_t vx, const hshg_pos_t vy) {
+  float lo = 0;
+  float hi = 1;
+  hshg_sweep_axis(a->x - b->x, vx, a->w + b->w + hshg->skin, &lo, &hi);
+  hshg_sweep_axis(a->y - b->y, vy, a->h + b->h + hshg->skin, &lo, &hi);
+  if(lo > hi) return;
+  hshg->toi = 1 - hi;
+  hshg_collide_found(hshg, a, b);
+  hshg->toi = 1;
+}
+
+#endif // HSHG_VELOCITY
+
+/* While the HSHG is contiguous, cells are walked as spans of the entities
+array instead of following the chains, so there are no dependent loads.
+Otherwise, the next entity of a chain is prefetched before the current one
+is handed to the callback, so that the callback hides the latency. */
+
+static int hshg_sweep_cmp(const void* a, const void* b) {
+  const hshg_pos_t x = ((const struct hshg_sweep*) a)->min;
+  const hshg_pos_t y = ((const struct hshg_sweep*) b)->min;
+  return (x > y) - (x < y);
+}
+
+/* A crowded cell is sorted by the left edges of its entities, and then only
+entities overlapping on the x axis are paired up, in O(n log n + pairs)
+instead of O(n^2). Nothing is kept around, so once a crowd spreads out, its
+cell goes back to plain loops. */
+static void hshg_collide_crowded(struct hshg* const hshg, const hshg_entity_t head, const hshg_entity_t count) {
+  if(count > hshg->sweep_size) {
+    hshg->sweep_size = count;
+    hshg->sweep = shnet_realloc(hshg->sweep, sizeof(*hshg->sweep) * hshg->sweep_size);
+    assert(hshg->sweep);
+  }
+  /* Pairs within the skin have to be kept as well */
+  const hshg_pos_t skin = hshg_half(hshg->skin);
+  hshg_entity_t i = head;
+  for(hshg_entity_t k = 0; k < count; ++k) {
+    const struct hshg_entity* const entity = hshg->entities + i;
+    hshg->sweep[k].min = entity->x - entity->w - skin;
+    hshg->sweep[k].max = entity->x + entity->w + skin;
+    hshg->sweep[k].entity = entity;
+    i = hshg->contiguous ? i + 1 : entity->next;
+  }
+  qsort(hshg->sweep, count, sizeof(*hshg->sweep), hshg_sweep_cmp);
+  for(hshg_entity_t a = 0; a < count; ++a) {
+    const struct hshg_entity* const entity = hshg->sweep[a].entity;
+    for(hshg_entity_t b = a + 1; b < count && hshg->sweep[b].min <= hshg->sweep[a].max; ++b) {
+      hshg_collide_pair(hshg, entity, hshg->sweep[b].entity);
+    }
+  }
+}
+
+/* Bounds are in units of 2^log, where log is picked so that no entity on
+the grids is wider than 2^13 units. Any two entities that overlap are then
+closer than 2^15 units, so wrapped differences between their bounds keep
+the right sign, and entities far enough apart to wrap around can only be
+false positives. The bounds are rounded outwards, so there are no false
+negatives. With the minimums negated, bounds overlap on an axis if both
+a.max + -b.min and b.max + -a.min aren't negative. */
+static void hshg_pack_bounds(struct hshg* const hshg, const uint8_t top) {
+  /* AVX2 reads up to 3 bounds past a span */
+  if(hshg->entities_used + 3 > hshg->bounds_size) {
+    hshg->bounds_size = hshg->entities_size + 3;
+    hshg->bounds = shnet_realloc(hshg->bounds, sizeof(*hshg->bounds) * hshg->bounds_size);
+    assert(hshg->bounds);
+  }
+  /* Rounded up, since cell sizes aren't powers of two without HSHG_FIXED */
+  const uint32_t cell_size = hshg->grids[top - 1].cell_size;
+  const uint8_t cell_log = cell_size > 1 ? 32 - __builtin_clz(cell_size - 1) : 0;
+  const uint8_t log = cell_log > 13 ? cell_log - 13 : 0;
+  const hshg_pos_t skin = hshg_half(hshg->skin);
+#ifndef HSHG_FIXED
+  const float inverse = 1.0f / (UINT32_C(1) << log);
+#endif
   for(hshg_entity_t i = 1; i < hshg->entities_used; ++i) {
     const struct hshg_entity* const entity = hshg->entities + i;
-    if(entity->cell == hshg_cell_sq_max) continue;
-    const struct hshg_grid* grid = hshg->grids + entity->grid;
+    const hshg_pos_t w = entity->w + skin;
+    const hshg_pos_t h = entity->h + skin;
+    struct hshg_bounds* const bounds = hshg->bounds + i;
+#ifdef HSHG_FIXED
+    bounds->min_x = -(uint32_t)((entity->x - w) >> log);
+    bounds->min_y = -(uint32_t)((entity->y - h) >> log);
+    bounds->max_x = (entity->x + w) >> log;
+    bounds->max_y = (entity->y + h) >> log;
+#else
+    /* Truncation moves towards 0, the extra 1 also covers float rounding */
+    bounds->min_x = -(uint32_t)((int32_t)((entity->x - w) * inverse) - 1);
+    bounds->min_y = -(uint32_t)((int32_t)((entity->y - h) * inverse) - 1);
+    bounds->max_x = (int32_t)((entity->x + w) * inverse) + 1;
+    bounds->max_y = (int32_t)((entity->y + h) * inverse) + 1;
+#endif
+  }
+}
+
+#ifndef __AVX2__
+static int hshg_bounds_overlap(const struct hshg_bounds* const a, const struct hshg_bounds* const b) {
+  return (int16_t)(a->max_x + b->min_x) >= 0 && (int16_t)(a->max_y + b->min_y) >= 0 &&
+    (int16_t)(b->max_x + a->min_x) >= 0 && (int16_t)(b->max_y + a->min_y) >= 0;
+}
+#endif
+
+/* Pairs an entity with the entities in [i, end) of a contiguous HSHG */
+static void hshg_collide_span(struct hshg* const hshg, const hshg_entity_t idx, hshg_entity_t i, const hshg_entity_t end) {
+  const struct hshg_entity* const entity = hshg->entities + idx;
+  if(!hshg->quantize) {
+    for(; i < end; ++i) {
+      hshg_collide_pair(hshg, entity, hshg->entities + i);
+    }
+    return;
+  }
+  const struct hshg_bounds* const bounds = hshg->bounds + idx;
+#ifdef __AVX2__
+  /* Lined up so that adding the bounds of other entities gives the 4 sums
+  that must not be negative */
+  const __m256i swapped = _mm256_set1_epi64x((int64_t)(bounds->max_x | ((uint64_t) bounds->max_y << 16) |
+    ((uint64_t) bounds->min_x << 32) | ((uint64_t) bounds->min_y << 48)));
+  for(; i < end; i += 4) {
+    const __m256i sums = _mm256_add_epi16(swapped, _mm256_loadu_si256((const __m256i*)(hshg->bounds + i)));
+    /* The sign bits of every entity's 4 sums */
+    const uint32_t negative = _mm256_movemask_epi8(sums) & 0xAAAAAAAA;
+    const hshg_entity_t len = end - i < 4 ? end - i : 4;
+    for(hshg_entity_t k = 0; k < len; ++k) {
+      if(((negative >> (k << 3)) & 0xFF) == 0) {
+        hshg_collide_pair(hshg, entity, hshg->entities + i + k);
+      }
+    }
+  }
+#else
+  for(; i < end; ++i) {
+    if(hshg_bounds_overlap(bounds, hshg->bounds + i)) {
+      hshg_collide_pair(hshg, entity, hshg->entities + i);
+    }
+  }
+#endif
+}
+
+static void hshg_collide_cell(struct hshg* const hshg, const hshg_entity_t head, const hshg_entity_t count) {
+  if(count > hshg->crowded) {
+    hshg_collide_crowded(hshg, head, count);
+    return;
+  }
+  if(hshg->contiguous) {
+    for(hshg_entity_t i = head; i < head + count; ++i) {
+      hshg_collide_span(hshg, i, i + 1, head + count);
+    }
+    return;
+  }
+  for(hshg_entity_t i = head; i != 0;) {
+    const struct hshg_entity* const entity = hshg->entities + i;
     for(hshg_entity_t j = entity->next; j != 0;) {
       const struct hshg_entity* const ent = hshg->entities + j;
-      hshg->collide(hshg, entity, ent);
       j = ent->next;
+      __builtin_prefetch(hshg->entities + j);
+      hshg_collide_pair(hshg, entity, ent);
+    }
+    i = entity->next;
+  }
+}
+
+static void hshg_collide_cells(struct hshg* const hshg, const hshg_entity_t head, const hshg_entity_t count, const hshg_entity_t other, const hshg_entity_t other_count) {
+  if(hshg->contiguous) {
+    for(hshg_entity_t i = head; i < head + count; ++i) {
+      hshg_collide_span(hshg, i, other, other + other_count);
+    }
+    return;
+  }
+  for(hshg_entity_t i = head; i != 0;) {
+    const struct hshg_entity* const entity = hshg->entities + i;
+    for(hshg_entity_t j = other; j != 0;) {
+      const struct hshg_entity* const ent = hshg->entities + j;
+      j = ent->next;
+      __builtin_prefetch(hshg->entities + j);
+      hshg_collide_pair(hshg, entity, ent);
+    }
+    i = entity->next;
+  }
+}
+
+struct hshg_span {
+  hshg_entity_t head;
+  hshg_entity_t count;
+};
+
+/* 4 cells on the same grid, and at most 3x3 cells on every grid above */
+#define HSHG_SPANS_MAX (4 + 9 * (sizeof(hshg_cell_t) << 3))
+
+/* An entity never reaches further than half of its cell's size out of its
+cell, counting in the margin. For a cell of a lower grid and a grid whose
+cells are "scale" times larger, that gives every cell of the upper grid
+that can have an entity overlapping any entity of the lower cell. In units
+of lower cells, entities of lower cell c stay within [c - 1/2, c + 3/2), and
+entities of upper cell u within [(u - 1/2) * scale, (u + 3/2) * scale). The
+two can only touch for u above (2c - 1 - 3 * scale) / (2 * scale) and below
+(2c + 3 + scale) / (2 * scale), which is up to 3 upper cells per axis. Only
+looking at the upper cell right above c, or the 2x2 block around it, misses
+pairs between the grids. */
+static hshg_cell_t grid_up_min(const hshg_cell_t cell, const uint8_t scale_log) {
+  const int64_t num = ((int64_t) cell << 1) - 1 - (INT64_C(3) << scale_log);
+  return num < 0 ? 0 : (num >> (scale_log + 1)) + 1;
+}
+
+static hshg_cell_t grid_up_max(const struct hshg_grid* const up, const hshg_cell_t cell, const uint8_t scale_log) {
+  const int64_t num = ((int64_t) cell << 1) + 3 + (INT64_C(3) << scale_log) - 1;
+  const int64_t max = (num >> (scale_log + 1)) - 1;
+  return max < up->cells_mask ? max : up->cells_mask;
+}
+
+static void hshg_add_span(const struct hshg* const hshg, struct hshg_span* const spans, uint32_t* const len, const struct hshg_grid* const grid, const hshg_cell_sq_t cell) {
+  if(!grid_is_used(grid, cell)) return;
+  const hshg_entity_t head = grid->cells[cell];
+  __builtin_prefetch(hshg->entities + head);
+  spans[*len].head = head;
+  spans[*len].count = grid->counts[cell];
+  ++*len;
+}
+
+static void hshg_collide_giants(struct hshg* const);
+
+/* Hands the pairs remembered because of the skin to the callback if they
+can still be used */
+static int hshg_collide_replay(struct hshg* const hshg) {
+  if(!hshg->pairs_valid) {
+    return 0;
+  }
+  if(hshg_has_collide(hshg)) {
+    for(uint32_t i = 0; i < hshg->pairs_len; ++i) {
+      hshg_call_collide(hshg, hshg->entities + hshg->pairs[i].a, hshg->entities + hshg->pairs[i].b);
     }
-    hshg_cell_t cell_x = entity->cell & grid->cells_mask;
-    hshg_cell_t cell_y = entity->cell >> grid->cells_log;
+  }
+  return 1;
+}
+
+static uint8_t hshg_collide_begin(struct hshg* const hshg) {
+  hshg->pairs_len = 0;
+  /* Grids above the last one with any entities don't need to be visited. */
+  uint8_t top = hshg->grids_len;
+  while(top != 0 && hshg->grids[top - 1].entities_len == 0) {
+    --top;
+  }
+  if(hshg->quantize && hshg->contiguous && top != 0) {
+    hshg_pack_bounds(hshg, top);
+  }
+  return top;
+}
+
+/* Cell-major: every entity of a cell shares the same neighbourhood, so the
+neighbouring heads are only loaded once per used cell, not once per entity.
+All of them are gathered and prefetched first, so that the first misses of
+all neighbouring chains overlap instead of being taken one by one. */
+static void hshg_collide_used(struct hshg* const hshg, const uint8_t top, const uint8_t g, const hshg_cell_sq_t from, const hshg_cell_sq_t to) {
+  const struct hshg_grid* const grid = hshg->grids + g;
+  struct hshg_span spans[HSHG_SPANS_MAX];
+  for(hshg_cell_sq_t u = from; u < to; ++u) {
+    if(u + 1 < to) {
+      __builtin_prefetch(hshg->entities + grid->cells[grid->used_cells[u + 1]]);
+    }
+    const hshg_cell_sq_t cell = grid->used_cells[u];
+    const hshg_entity_t head = grid->cells[cell];
+    const hshg_entity_t count = grid->counts[cell];
+    uint32_t spans_len = 0;
+    const hshg_cell_t cell_x = grid_cell_x(grid, cell);
+    const hshg_cell_t cell_y = grid_cell_y(grid, cell);
     if(cell_x != 0) {
-      for(hshg_entity_t j = grid->cells[entity->cell - 1]; j != 0;) {
-        const struct hshg_entity* const ent = hshg->entities + j;
-        hshg->collide(hshg, entity, ent);
-        j = ent->next;
-      }
+      hshg_add_span(hshg, spans, &spans_len, grid, grid_cell(grid, cell_x - 1, cell_y));
       if(cell_y != grid->cells_mask) {
-        for(hshg_entity_t j = grid->cells[entity->cell + grid->cells_side - 1]; j != 0;) {
-          const struct hshg_entity* const ent = hshg->entities + j;
-          hshg->collide(hshg, entity, ent);
-          j = ent->next;
-        }
+        hshg_add_span(hshg, spans, &spans_len, grid, grid_cell(grid, cell_x - 1, cell_y + 1));
       }
     }
     if(cell_y != grid->cells_mask) {
-      for(hshg_entity_t j = grid->cells[entity->cell + grid->cells_side]; j != 0;) {
-        const struct hshg_entity* const ent = hshg->entities + j;
-        hshg->collide(hshg, entity, ent);
-        j = ent->next;
-      }
+      hshg_add_span(hshg, spans, &spans_len, grid, grid_cell(grid, cell_x, cell_y + 1));
       if(cell_x != grid->cells_mask) {
-        for(hshg_entity_t j = grid->cells[entity->cell + grid->cells_side + 1]; j != 0;) {
-          const struct hshg_entity* const ent = hshg->entities + j;
-          hshg->collide(hshg, entity, ent);
-          j = ent->next;
+        hshg_add_span(hshg, spans, &spans_len, grid, grid_cell(grid, cell_x + 1, cell_y + 1));
+      }
+    }
+    for(uint8_t up_grid = g + 1; up_grid < top; ++up_grid) {
+      const struct hshg_grid* const up = hshg->grids + up_grid;
+      if(up->entities_len == 0) continue;
+      const uint8_t scale_log = hshg->cell_div_log * (up_grid - g);
+      const hshg_cell_t min_x = grid_up_min(cell_x, scale_log);
+      const hshg_cell_t min_y = grid_up_min(cell_y, scale_log);
+      const hshg_cell_t max_x = grid_up_max(up, cell_x, scale_log);
+      const hshg_cell_t max_y = grid_up_max(up, cell_y, scale_log);
+      for(hshg_cell_t cur_y = min_y; cur_y <= max_y; ++cur_y) {
+        for(hshg_cell_t cur_x = min_x; cur_x <= max_x; ++cur_x) {
+          hshg_add_span(hshg, spans, &spans_len, up, grid_cell(up, cur_x, cur_y));
         }
       }
     }
-    if(cell_x != 0) {
-      --cell_x;
-    }
-    if(cell_y != 0) {
-      --cell_y;
-    }
-    hshg_cell_t max_cell_x = cell_x != grid->cells_mask ? cell_x + 1 : cell_x;
-    hshg_cell_t max_cell_y = cell_y != grid->cells_mask ? cell_y + 1 : cell_y;
-    for(uint8_t up_grid = entity->grid + 1; up_grid < hshg->grids_len; ++up_grid) {
-      ++grid;
-      cell_x >>= hshg->cell_div_log;
-      cell_y >>= hshg->cell_div_log;
-      max_cell_x >>= hshg->cell_div_log;
-      max_cell_y >>= hshg->cell_div_log;
-      for(hshg_cell_t cur_y = cell_y; cur_y <= max_cell_y; ++cur_y) {
-        for(hshg_cell_t cur_x = cell_x; cur_x <= max_cell_x; ++cur_x) {
-          for(hshg_entity_t j = grid->cells[(hshg_cell_sq_t) cur_x | (cur_y << grid->cells_log)]; j != 0;) {
-            const struct hshg_entity* const ent = hshg->entities + j;
-            hshg->collide(hshg, entity, ent);
-            j = ent->next;
+    hshg_collide_cell(hshg, head, count);
+    for(uint32_t k = 0; k < spans_len; ++k) {
+      hshg_collide_cells(hshg, head, count, spans[k].head, spans[k].count);
+    }
+  }
+}
+
+static void hshg_collide_end(struct hshg* const hshg) {
+  hshg_collide_giants(hshg);
+  if(hshg->skin != 0) {
+    hshg->pairs_pos = shnet_realloc(hshg->pairs_pos, sizeof(*hshg->pairs_pos) * ((uint64_t) hshg->entities_used << 1));
+    assert(hshg->pairs_pos);
+    for(hshg_entity_t i = 1; i < hshg->entities_used; ++i) {
+      hshg->pairs_pos[(uint64_t) i << 1] = hshg->entities[i].x;
+      hshg->pairs_pos[((uint64_t) i << 1) + 1] = hshg->entities[i].y;
+    }
+    hshg->pairs_valid = 1;
+  }
+}
+
+void hshg_collide(struct hshg* const hshg) {
+  if(hshg_collide_replay(hshg)) return;
+  const uint8_t top = hshg_collide_begin(hshg);
+  for(uint8_t g = 0; g < top; ++g) {
+    hshg_collide_used(hshg, top, g, 0, hshg->grids[g].used);
+  }
+  hshg_collide_end(hshg);
+}
+
+/* Monotonic, so that the budget doesn't jump with the wall clock */
+static uint64_t hshg_time_ns(void) {
+  struct timespec ts;
+  (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* The clock is read after every this many used cells or remembered pairs */
+#define HSHG_STEP_CELLS 8
+#define HSHG_STEP_PAIRS 64
+
+/* Does hshg_collide() bit by bit, for about budget_ns every call, so that it
+can be spread over spare time. At least some work is done every call, and
+giants are all done at once at the end. Returns 1 and zeroes the cursor
+once the pass is over. The HSHG must not change until then. */
+int hshg_collide_step(struct hshg* const hshg, const uint64_t budget_ns, struct hshg_cursor* const cursor) {
+  const uint64_t deadline = hshg_time_ns() + budget_ns;
+  if(cursor->state == 0) {
+    if(hshg->pairs_valid) {
+      cursor->state = 1;
+      cursor->pairs = 0;
+    } else {
+      cursor->state = 2;
+      cursor->top = hshg_collide_begin(hshg);
+      cursor->grid = 0;
+      cursor->used = 0;
+    }
+  }
+  if(cursor->state == 1) {
+    while(hshg_has_collide(hshg) && cursor->pairs < hshg->pairs_len) {
+      const uint32_t end = hshg->pairs_len - cursor->pairs > HSHG_STEP_PAIRS ? cursor->pairs + HSHG_STEP_PAIRS : hshg->pairs_len;
+      for(; cursor->pairs < end; ++cursor->pairs) {
+        hshg_call_collide(hshg, hshg->entities + hshg->pairs[cursor->pairs].a, hshg->entities + hshg->pairs[cursor->pairs].b);
+      }
+      if(cursor->pairs != hshg->pairs_len && hshg_time_ns() >= deadline) {
+        return 0;
+      }
+    }
+    *cursor = (struct hshg_cursor){0};
+    return 1;
+  }
+  for(; cursor->grid < cursor->top; ++cursor->grid, cursor->used = 0) {
+    const struct hshg_grid* const grid = hshg->grids + cursor->grid;
+    while(cursor->used < grid->used) {
+      const hshg_cell_sq_t end = grid->used - cursor->used > HSHG_STEP_CELLS ? cursor->used + HSHG_STEP_CELLS : grid->used;
+      hshg_collide_used(hshg, cursor->top, cursor->grid, cursor->used, end);
+      cursor->used = end;
+      if(hshg_time_ns() >= deadline) {
+        return 0;
+      }
+    }
+  }
+  hshg_collide_end(hshg);
+  *cursor = (struct hshg_cursor){0};
+  return 1;
+}
+
+#undef HSHG_STEP_PAIRS
+#undef HSHG_STEP_CELLS
+
+#ifdef HSHG_THREADS
+
+/* A run of used cells of one grid, and where its pairs went */
+struct hshg_task {
+  uint8_t grid;
+  hshg_cell_sq_t from;
+  hshg_cell_sq_t to;
+  uint32_t worker;
+  uint32_t pairs_from;
+  uint32_t pairs_to;
+};
+
+/* Every worker collides on its own shallow copy of the HSHG, so that pairs,
+the sweep buffer and toi aren't shared. Its pairs and sweep buffer are kept
+for the next call. The tasks it has left are the ones from range >> 32 up to
+the low 32 bits of range. */
+struct hshg_worker {
+  struct hshg hshg;
+  struct hshg_pool* pool;
+  uint64_t range;
+  uint32_t idx;
+  /* The last call this worker took part in */
+  uint32_t round;
+  uint8_t top;
+  pthread_t thread;
+};
+
+/* The owner takes tasks from the front of its range */
+static int hshg_worker_take(struct hshg_worker* const worker, uint32_t* const task) {
+  uint64_t range = __atomic_load_n(&worker->range, __ATOMIC_ACQUIRE);
+  while((uint32_t)(range >> 32) < (uint32_t) range) {
+    if(__atomic_compare_exchange_n(&worker->range, &range, range + (UINT64_C(1) << 32), 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      *task = range >> 32;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Thieves take the back half of someone else's range */
+static int hshg_worker_steal(struct hshg_worker* const worker) {
+  const struct hshg_pool* const pool = worker->pool;
+  for(uint32_t i = 1; i < pool->threads; ++i) {
+    struct hshg_worker* const victim = pool->workers + (worker->idx + i) % pool->threads;
+    uint64_t range = __atomic_load_n(&victim->range, __ATOMIC_ACQUIRE);
+    while((uint32_t)(range >> 32) < (uint32_t) range) {
+      const uint32_t end = range;
+      const uint32_t mid = end - (end - (uint32_t)(range >> 32) + 1) / 2;
+      if(__atomic_compare_exchange_n(&victim->range, &range, (range & ~UINT64_C(0xFFFFFFFF)) | mid, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        __atomic_store_n(&worker->range, ((uint64_t) mid << 32) | end, __ATOMIC_RELEASE);
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+static void hshg_worker_run(struct hshg_worker* const worker) {
+  uint32_t t;
+  do {
+    while(hshg_worker_take(worker, &t)) {
+      struct hshg_task* const task = worker->pool->tasks + t;
+      task->worker = worker->idx;
+      task->pairs_from = worker->hshg.pairs_len;
+      hshg_collide_used(&worker->hshg, worker->top, task->grid, task->from, task->to);
+      task->pairs_to = worker->hshg.pairs_len;
+    }
+  } while(hshg_worker_steal(worker));
+}
+
+/* Pool threads sleep until the next call bumps the round, or until the
+pool is freed */
+static void* hshg_worker_main(void* const data) {
+  struct hshg_worker* const worker = data;
+  struct hshg_pool* const pool = worker->pool;
+  pthread_mutex_lock(&pool->mutex);
+  while(1) {
+    while(pool->round == worker->round && !pool->stop) {
+      pthread_cond_wait(&pool->start, &pool->mutex);
+    }
+    if(pool->stop) break;
+    worker->round = pool->round;
+    pthread_mutex_unlock(&pool->mutex);
+    hshg_worker_run(worker);
+    pthread_mutex_lock(&pool->mutex);
+    if(--pool->running == 0) {
+      pthread_cond_signal(&pool->done);
+    }
+  }
+  pthread_mutex_unlock(&pool->mutex);
+  return NULL;
+}
+
+int hshg_pool_init(struct hshg_pool* const pool, const uint32_t threads) {
+  assert(threads > 0);
+  pool->workers = shnet_calloc(threads, sizeof(*pool->workers));
+  if(pool->workers == NULL) {
+    return -1;
+  }
+  if(pthread_mutex_init(&pool->mutex, NULL) != 0) {
+    free(pool->workers);
+    return -1;
+  }
+  if(pthread_cond_init(&pool->start, NULL) != 0) {
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool->workers);
+    return -1;
+  }
+  if(pthread_cond_init(&pool->done, NULL) != 0) {
+    pthread_cond_destroy(&pool->start);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool->workers);
+    return -1;
+  }
+  pool->tasks = NULL;
+  pool->tasks_size = 0;
+  pool->round = 0;
+  pool->running = 0;
+  pool->stop = 0;
+  pool->workers[0].pool = pool;
+  /* The calling thread is the first worker */
+  for(pool->threads = 1; pool->threads < threads; ++pool->threads) {
+    struct hshg_worker* const worker = pool->workers + pool->threads;
+    worker->pool = pool;
+    worker->idx = pool->threads;
+    if(pthread_create(&worker->thread, NULL, hshg_worker_main, worker) != 0) {
+      hshg_pool_free(pool);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void hshg_pool_free(struct hshg_pool* const pool) {
+  pthread_mutex_lock(&pool->mutex);
+  pool->stop = 1;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->mutex);
+  for(uint32_t w = 1; w < pool->threads; ++w) {
+    pthread_join(pool->workers[w].thread, NULL);
+  }
+  for(uint32_t w = 0; w < pool->threads; ++w) {
+    free(pool->workers[w].hshg.pairs);
+    free(pool->workers[w].hshg.sweep);
+  }
+  pthread_cond_destroy(&pool->done);
+  pthread_cond_destroy(&pool->start);
+  pthread_mutex_destroy(&pool->mutex);
+  free(pool->workers);
+  free(pool->tasks);
+  pool->workers = NULL;
+  pool->tasks = NULL;
+  pool->tasks_size = 0;
+  pool->threads = 0;
+}
+
+/* Like hshg_collide(), with the used cells split up between the threads of
+the pool, the calling one included. The callback is called from all of them
+at once, each with its own copy of the HSHG, which has the same entities.
+Tasks are runs of used cells with about the same number of entities, several
+per thread, and threads that run out of them steal from the others. Pairs
+kept for the skin or for hshg_respond() come out in the same order every
+time. */
+void hshg_collide_parallel(struct hshg* const hshg, struct hshg_pool* const pool) {
+  if(hshg_collide_replay(hshg)) return;
+  const uint8_t top = hshg_collide_begin(hshg);
+  const uint32_t threads = pool->threads;
+  uint64_t entities = 0;
+  for(uint8_t g = 0; g < top; ++g) {
+    entities += hshg->grids[g].entities_len;
+  }
+  const uint64_t per_task = entities / ((uint64_t) threads << 3) + 1;
+  uint32_t tasks_len = 0;
+  /* The first pass only counts the tasks */
+  for(int fill = 0; fill < 2; ++fill) {
+    tasks_len = 0;
+    for(uint8_t g = 0; g < top; ++g) {
+      const struct hshg_grid* const grid = hshg->grids + g;
+      hshg_cell_sq_t from = 0;
+      uint64_t count = 0;
+      for(hshg_cell_sq_t u = 0; u < grid->used; ++u) {
+        count += grid->counts[grid->used_cells[u]];
+        if(count >= per_task || u + 1 == grid->used) {
+          if(fill) {
+            pool->tasks[tasks_len].grid = g;
+            pool->tasks[tasks_len].from = from;
+            pool->tasks[tasks_len].to = u + 1;
           }
+          ++tasks_len;
+          from = u + 1;
+          count = 0;
+        }
+      }
+    }
+    if(!fill && tasks_len > pool->tasks_size) {
+      pool->tasks_size = tasks_len;
+      pool->tasks = shnet_realloc(pool->tasks, sizeof(*pool->tasks) * pool->tasks_size);
+      assert(pool->tasks);
+    }
+  }
+  for(uint32_t w = 0; w < threads; ++w) {
+    struct hshg_worker* const worker = pool->workers + w;
+    struct hshg_pair* const pairs = worker->hshg.pairs;
+    const uint32_t pairs_size = worker->hshg.pairs_size;
+    struct hshg_sweep* const sweep = worker->hshg.sweep;
+    const hshg_entity_t sweep_size = worker->hshg.sweep_size;
+    worker->hshg = *hshg;
+    worker->hshg.pairs = pairs;
+    worker->hshg.pairs_len = 0;
+    worker->hshg.pairs_size = pairs_size;
+    worker->hshg.sweep = sweep;
+    worker->hshg.sweep_size = sweep_size;
+    worker->range = ((uint64_t)((uint64_t) tasks_len * w / threads) << 32) | (uint64_t) tasks_len * (w + 1) / threads;
+    worker->top = top;
+  }
+  /* The mutex publishes the workers' copies to their threads, and their
+  pairs back to this one */
+  pthread_mutex_lock(&pool->mutex);
+  ++pool->round;
+  pool->running = threads - 1;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->mutex);
+  hshg_worker_run(pool->workers);
+  pthread_mutex_lock(&pool->mutex);
+  while(pool->running != 0) {
+    pthread_cond_wait(&pool->done, &pool->mutex);
+  }
+  pthread_mutex_unlock(&pool->mutex);
+  if(hshg->skin != 0 || !hshg_has_collide(hshg)) {
+    for(uint32_t t = 0; t < tasks_len; ++t) {
+      const struct hshg_task* const task = pool->tasks + t;
+      const uint32_t len = task->pairs_to - task->pairs_from;
+      if(len == 0) continue;
+      const struct hshg_pair* const pairs = pool->workers[task->worker].hshg.pairs + task->pairs_from;
+      if(hshg->pairs_len + len > hshg->pairs_size) {
+        while(hshg->pairs_len + len > hshg->pairs_size) {
+          hshg->pairs_size = hshg->pairs_size != 0 ? hshg->pairs_size << 1 : 64;
         }
+        hshg->pairs = shnet_realloc(hshg->pairs, sizeof(*hshg->pairs) * hshg->pairs_size);
+        assert(hshg->pairs);
       }
+      memcpy(hshg->pairs + hshg->pairs_len, pairs, sizeof(*pairs) * len);
+      hshg->pairs_len += len;
+    }
+  }
+  hshg_collide_end(hshg);
+}
+
+#endif // HSHG_THREADS
+
+/* Copies the chain starting at i to entities from idx onwards, returning the
+index past its end */
+static hshg_entity_t hshg_copy_chain(const struct hshg* const hshg, struct hshg_entity* const entities, hshg_entity_t i, hshg_entity_t idx) {
+  while(1) {
+    struct hshg_entity* const entity = entities + idx;
+    *entity = hshg->entities[i];
+    if(entity->prev != 0) {
+      entity->prev = idx - 1;
+    }
+    ++idx;
+    if(entity->next != 0) {
+      i = entity->next;
+      entity->next = idx;
+    } else {
+      return idx;
+    }
+  }
+}
+
+#ifdef HSHG_VELOCITY
+
+#define HSHG_RESPOND_BATCH 16
+
+/* Elastic response of equal masses for pairs [from, to) of the last call to
+hshg_collide(), with entities taken as circles of radius w. Overlapping pairs
+closing in on each other swap their velocities along the line between their
+centres. Instead of the entities, the changes go to deltas, 2 per entity, so
+that ranges of pairs can be handled at the same time, each with its own
+deltas, to be summed up by hshg_apply() afterwards. Pairs are gathered in
+batches, so that the arithmetic runs over plain arrays without branches, which
+compilers vectorise for floats.
+There is no trigonometry nor square root involved, since the impulse along
+the unit normal d / |d| is the same as (dv . d) / (d . d) along d itself. */
+void hshg_respond(const struct hshg* const hshg, uint32_t from, const uint32_t to, hshg_pos_t* const deltas) {
+  hshg_pos_t dx[HSHG_RESPOND_BATCH];
+  hshg_pos_t dy[HSHG_RESPOND_BATCH];
+  hshg_pos_t dvx[HSHG_RESPOND_BATCH];
+  hshg_pos_t dvy[HSHG_RESPOND_BATCH];
+  hshg_pos_t rr[HSHG_RESPOND_BATCH];
+  while(from < to) {
+    const uint32_t len = to - from < HSHG_RESPOND_BATCH ? to - from : HSHG_RESPOND_BATCH;
+    const struct hshg_pair* const pairs = hshg->pairs + from;
+    for(uint32_t i = 0; i < len; ++i) {
+      const struct hshg_entity* const a = hshg->entities + pairs[i].a;
+      const struct hshg_entity* const b = hshg->entities + pairs[i].b;
+      dx[i] = a->x - b->x;
+      dy[i] = a->y - b->y;
+      dvx[i] = b->vx - a->vx;
+      dvy[i] = b->vy - a->vy;
+      rr[i] = a->w + b->w;
+    }
+    for(uint32_t i = 0; i < len; ++i) {
+#ifdef HSHG_FIXED
+      const int64_t dd = (int64_t) dx[i] * dx[i] + (int64_t) dy[i] * dy[i];
+      const int64_t dot = (int64_t) dvx[i] * dx[i] + (int64_t) dvy[i] * dy[i];
+      const int hit = dd <= (int64_t) rr[i] * rr[i] && dot > 0;
+      /* |dot * dx| is up to |dv| * dd, past 64 bits for positions in 16.16 */
+      dx[i] = hit ? (__int128) dot * dx[i] / dd : 0;
+      dy[i] = hit ? (__int128) dot * dy[i] / dd : 0;
+#else
+      const hshg_pos_t dd = dx[i] * dx[i] + dy[i] * dy[i];
+      const hshg_pos_t dot = dvx[i] * dx[i] + dvy[i] * dy[i];
+      const hshg_pos_t hit = (dd <= rr[i] * rr[i]) & (dot > 0);
+      /* Every pair is divided and masked after, dd of 0 is made 1 */
+      const hshg_pos_t j = dot / (dd + (dd == 0)) * hit;
+      dx[i] *= j;
+      dy[i] *= j;
+#endif
     }
+    for(uint32_t i = 0; i < len; ++i) {
+      const uint64_t a = (uint64_t) pairs[i].a << 1;
+      const uint64_t b = (uint64_t) pairs[i].b << 1;
+      deltas[a] += dx[i];
+      deltas[a + 1] += dy[i];
+      deltas[b] -= dx[i];
+      deltas[b + 1] -= dy[i];
+    }
+    from += len;
   }
 }
 
+#undef HSHG_RESPOND_BATCH
+
+/* Adds deltas from hshg_respond() to the velocities of entities */
+void hshg_apply(struct hshg* const hshg, const hshg_pos_t* const deltas) {
+  for(hshg_entity_t i = 1; i < hshg->entities_used; ++i) {
+    hshg->entities[i].vx += deltas[(uint64_t) i << 1];
+    hshg->entities[i].vy += deltas[((uint64_t) i << 1) + 1];
+  }
+}
+
+#endif // HSHG_VELOCITY
+
 void hshg_optimize(struct hshg* const hshg) {
   const hshg_entity_t size = hshg->entities_used << 1;
   hshg->entities_size = hshg->entities_size > size ? hshg_entity_max : size;
@@ -272,32 +1431,217 @@ void hshg_optimize(struct hshg* const hshg) {
   assert(entities);
   hshg_entity_t idx = 1;
   for(uint8_t i = 0; i < hshg->grids_len; ++i) {
-    const struct hshg_grid* const grid = hshg->grids + i;
-    const hshg_cell_sq_t sq = grid->cells_side * grid->cells_side;
-    for(hshg_cell_sq_t cell = 0; cell < sq; ++cell) {
-      hshg_entity_t i = grid->cells[cell];
-      if(i == 0) continue;
+    struct hshg_grid* const grid = hshg->grids + i;
+    const hshg_cell_sq_t words = ((hshg_cell_sq_t) grid->cells_side * grid->cells_side + 63) >> 6;
+    /* Rebuild the used cells list in cell order as well, so that
+    hshg_collide() goes through the new entity array sequentially. */
+    grid->used = 0;
+    for(hshg_cell_sq_t word = 0; word < words; ++word)
+    for(uint64_t bits = grid->bitmap[word]; bits != 0; bits &= bits - 1) {
+      const hshg_cell_sq_t cell = (word << 6) | __builtin_ctzll(bits);
+      const hshg_entity_t i = grid->cells[cell];
       grid->cells[cell] = idx;
-      while(1) {
-        struct hshg_entity* const entity = entities + idx;
-        *entity = hshg->entities[i];
-        if(entity->prev != 0) {
-          entity->prev = idx - 1;
-        }
-        ++idx;
-        if(entity->next != 0) {
-          i = entity->next;
-          entity->next = idx;
-        } else {
-          break;
-        }
-      }
+      grid->used_idx[cell] = grid->used;
+      grid->used_cells[grid->used++] = cell;
+      idx = hshg_copy_chain(hshg, entities, i, idx);
     }
   }
+  if(hshg->giants != 0) {
+    const hshg_entity_t i = hshg->giants;
+    hshg->giants = idx;
+    idx = hshg_copy_chain(hshg, entities, i, idx);
+  }
   free(hshg->entities);
   hshg->entities = entities;
   assert(hshg->entities_used == idx);
   hshg->free_entity = 0;
+  hshg->contiguous = 1;
+  hshg->pairs_valid = 0;
+}
+
+void hshg_rebuild(struct hshg* const hshg) {
+  /* Counting sort of all entities by their grid and cell. Only the cells
+  that were in use need to be cleared. */
+  for(uint8_t i = 0; i < hshg->grids_len; ++i) {
+    struct hshg_grid* const grid = hshg->grids + i;
+    for(hshg_cell_sq_t u = 0; u < grid->used; ++u) {
+      const hshg_cell_sq_t cell = grid->used_cells[u];
+      grid->cells[cell] = 0;
+      grid->counts[cell] = 0;
+      grid->bitmap[cell >> 6] = 0;
+    }
+    grid->used = 0;
+  }
+  for(hshg_entity_t i = 1; i < hshg->entities_used; ++i) {
+    struct hshg_entity* const entity = hshg->entities + i;
+    if(entity->cell == hshg_cell_sq_max || entity->grid == hshg_grid_giant) continue;
+    struct hshg_grid* const grid = hshg->grids + entity->grid;
+    entity->cell = grid_get_cell(grid, entity->x, entity->y);
+    if(grid->counts[entity->cell]++ == 0) {
+      grid->bitmap[entity->cell >> 6] |= UINT64_C(1) << (entity->cell & 63);
+    }
+  }
+  hshg_entity_t idx = 1;
+  for(uint8_t i = 0; i < hshg->grids_len; ++i) {
+    struct hshg_grid* const grid = hshg->grids + i;
+    const hshg_cell_sq_t words = ((hshg_cell_sq_t) grid->cells_side * grid->cells_side + 63) >> 6;
+    for(hshg_cell_sq_t word = 0; word < words; ++word)
+    for(uint64_t bits = grid->bitmap[word]; bits != 0; bits &= bits - 1) {
+      const hshg_cell_sq_t cell = (word << 6) | __builtin_ctzll(bits);
+      grid->cells[cell] = idx;
+      idx += grid->counts[cell];
+      grid_set_used(grid, cell);
+    }
+  }
+  struct hshg_entity* const entities = shnet_malloc(sizeof(*hshg->entities) * hshg->entities_size);
+  assert(entities);
+  /* Heads serve as insertion points, ending up one span past the start. */
+  for(hshg_entity_t i = 1; i < hshg->entities_used; ++i) {
+    const struct hshg_entity* const entity = hshg->entities + i;
+    if(entity->cell == hshg_cell_sq_max || entity->grid == hshg_grid_giant) continue;
+    entities[hshg->grids[entity->grid].cells[entity->cell]++] = *entity;
+  }
+  /* Giants go after all grids */
+  if(hshg->giants != 0) {
+    const hshg_entity_t i = hshg->giants;
+    hshg->giants = idx;
+    idx = hshg_copy_chain(hshg, entities, i, idx);
+  }
+  for(uint8_t i = 0; i < hshg->grids_len; ++i) {
+    struct hshg_grid* const grid = hshg->grids + i;
+    for(hshg_cell_sq_t u = 0; u < grid->used; ++u) {
+      const hshg_cell_sq_t cell = grid->used_cells[u];
+      const hshg_entity_t end = grid->cells[cell];
+      const hshg_entity_t head = end - grid->counts[cell];
+      grid->cells[cell] = head;
+      for(hshg_entity_t j = head; j != end; ++j) {
+        entities[j].prev = j != head ? j - 1 : 0;
+        entities[j].next = j + 1 != end ? j + 1 : 0;
+      }
+    }
+  }
+  free(hshg->entities);
+  hshg->entities = entities;
+  hshg->entities_used = idx;
+  hshg->free_entity = 0;
+  hshg->contiguous = 1;
+  hshg->pairs_valid = 0;
+}
+
+/* Makes dst, zeroed before its first use, a copy of src that
+hshg_collide(), hshg_respond() and hshg_query() can run on while src goes on
+to the next frame, with dst's buffers reused between calls. Cells are only
+read when their bit is set, so only the used ones are copied. dst can't be
+changed any other way, and is freed with hshg_free(). */
+void hshg_snapshot(struct hshg* const dst, const struct hshg* const src) {
+  const struct hshg old = *dst;
+  *dst = *src;
+  dst->entities = old.entities;
+  dst->entities_size = old.entities_size;
+  dst->grids = old.grids;
+  dst->cells = old.cells;
+  dst->counts = old.counts;
+  dst->bitmap = old.bitmap;
+  dst->used_idx = NULL;
+  dst->pairs = old.pairs;
+  dst->pairs_pos = old.pairs_pos;
+  dst->pairs_size = old.pairs_size;
+  dst->pairs_len = 0;
+  dst->pairs_valid = 0;
+  dst->sweep = old.sweep;
+  dst->sweep_size = old.sweep_size;
+  dst->moved = old.moved;
+  dst->moved_size = old.moved_size;
+  dst->bounds = old.bounds;
+  dst->bounds_size = old.bounds_size;
+#ifdef HSHG_VELOCITY
+  dst->toi = 1;
+#endif
+  /* The pyramid starts with the coarsest grid and ends with the first one */
+  const struct hshg_grid* const first = src->grids;
+  const hshg_cell_sq_t cells_len = (first->cells - src->cells) + (hshg_cell_sq_t) first->cells_side * first->cells_side;
+  const hshg_cell_sq_t bitmap_len = (first->bitmap - src->bitmap) + (((hshg_cell_sq_t) first->cells_side * first->cells_side + 63) >> 6);
+  if(dst->grids == NULL) {
+    dst->grids = shnet_calloc(src->grids_size, sizeof(*dst->grids));
+    dst->cells = shnet_malloc(sizeof(*dst->cells) * cells_len);
+    dst->counts = shnet_malloc(sizeof(*dst->counts) * cells_len);
+    dst->bitmap = shnet_malloc(sizeof(*dst->bitmap) * bitmap_len);
+    assert(dst->grids && dst->cells && dst->counts && dst->bitmap);
+  }
+  if(src->entities_used > dst->entities_size) {
+    dst->entities_size = src->entities_size;
+    dst->entities = shnet_realloc(dst->entities, sizeof(*dst->entities) * dst->entities_size);
+    assert(dst->entities);
+  }
+  memcpy(dst->entities, src->entities, sizeof(*dst->entities) * src->entities_used);
+  memcpy(dst->bitmap, src->bitmap, sizeof(*dst->bitmap) * bitmap_len);
+  for(uint8_t i = 0; i < src->grids_size; ++i) {
+    const struct hshg_grid* const from = src->grids + i;
+    struct hshg_grid* const grid = dst->grids + i;
+    hshg_cell_sq_t* used_cells = grid->used_cells;
+    hshg_cell_sq_t used_size = grid->used_size;
+    if(from->used > used_size) {
+      used_size = from->used_size;
+      used_cells = shnet_realloc(used_cells, sizeof(*used_cells) * used_size);
+      assert(used_cells);
+    }
+    *grid = *from;
+    grid->cells = dst->cells + (from->cells - src->cells);
+    grid->counts = dst->counts + (from->counts - src->counts);
+    grid->bitmap = dst->bitmap + (from->bitmap - src->bitmap);
+    grid->used_idx = NULL;
+    grid->used_cells = used_cells;
+    grid->used_size = used_size;
+    for(hshg_cell_sq_t u = 0; u < from->used; ++u) {
+      const hshg_cell_sq_t cell = from->used_cells[u];
+      grid->used_cells[u] = cell;
+      grid->cells[cell] = from->cells[cell];
+      grid->counts[cell] = from->counts[cell];
+    }
+  }
+}
+
+/* The writer only ever writes a snapshot that isn't the latest one and has
+no readers. A reader that comes late to one checks that it's still the
+latest after announcing itself, and otherwise backs off, so it's either
+seen by the writer or it doesn't read anything. If every other snapshot is
+still being read, nothing is published and -1 is returned. */
+int hshg_publish(struct hshg_shared* const shared, const struct hshg* const hshg) {
+  const uint8_t latest = __atomic_load_n(&shared->latest, __ATOMIC_SEQ_CST);
+  for(uint8_t i = 0; i < 3; ++i) {
+    if(i + 1 == latest || __atomic_load_n(shared->readers + i, __ATOMIC_SEQ_CST) != 0) continue;
+    hshg_snapshot(shared->shots + i, hshg);
+    __atomic_store_n(&shared->latest, i + 1, __ATOMIC_SEQ_CST);
+    return 0;
+  }
+  return -1;
+}
+
+/* Returns NULL until the first snapshot is published. Whatever is returned
+stays the same until it's handed back to hshg_release(). */
+const struct hshg* hshg_acquire(struct hshg_shared* const shared) {
+  while(1) {
+    const uint8_t latest = __atomic_load_n(&shared->latest, __ATOMIC_SEQ_CST);
+    if(latest == 0) {
+      return NULL;
+    }
+    __atomic_add_fetch(shared->readers + latest - 1, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&shared->latest, __ATOMIC_SEQ_CST) == latest) {
+      return shared->shots + latest - 1;
+    }
+    __atomic_sub_fetch(shared->readers + latest - 1, 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+void hshg_release(struct hshg_shared* const shared, const struct hshg* const shot) {
+  __atomic_sub_fetch(shared->readers + (shot - shared->shots), 1, __ATOMIC_RELEASE);
+}
+
+void hshg_shared_free(struct hshg_shared* const shared) {
+  for(uint8_t i = 0; i < 3; ++i) {
+    hshg_free(shared->shots + i);
+  }
+  shared->latest = 0;
 }
 
 #define min(a, b) ({ \
@@ -312,90 +1656,142 @@ void hshg_optimize(struct hshg* const hshg) {
   _a > _b ? _a : _b; \
 })
 
-void hshg_query(const struct hshg* const hshg, const hshg_pos_t _x1, const hshg_pos_t _y1, const hshg_pos_t _x2, const hshg_pos_t _y2) {
-  /* ^ +y
-     -------------
-     |      x2,y2|
-     |           |
-     |x1,y1      |
-     -------------> +x */
-  hshg_pos_t x1;
-  hshg_pos_t x2;
-  if(_x1 < 0) {
-    const hshg_pos_t shift = (((hshg_cell_t)(-_x1 * hshg->inverse_grid_size) << 1) + 2) * hshg->grid_size;
-    x1 = _x1 + shift;
-    x2 = _x2 + shift;
+static int hshg_entity_in_rect(const struct hshg_entity* const entity, const hshg_pos_t x1, const hshg_pos_t y1, const hshg_pos_t x2, const hshg_pos_t y2) {
+  return entity->x + entity->w >= x1 && entity->x - entity->w <= x2 && entity->y + entity->h >= y1 && entity->y - entity->h <= y2;
+}
+
+/* The callback and its data given to hshg_query_with(). Without a callback,
+the query callback of the HSHG is used. */
+struct hshg_query_to {
+  void (*query)(const struct hshg*, const struct hshg_entity*, void*);
+  void* data;
+};
+
+/* Entities found by a query are either handed to the query callback, or if
+the query is made on behalf of a giant, paired up with it. Only the latter
+modifies the HSHG. */
+static void hshg_query_found(struct hshg* const hshg, const struct hshg_entity* const giant, const struct hshg_query_to* const to, const struct hshg_entity* const entity) {
+  if(giant != NULL) {
+#ifdef HSHG_VELOCITY
+    if(hshg->ccd) {
+      hshg_collide_swept(hshg, giant, entity, giant->vx, giant->vy);
+      return;
+    }
+#endif
+    hshg_collide_pair(hshg, giant, entity);
+  } else if(to->query != NULL) {
+    to->query(hshg, entity, to->data);
   } else {
-    x1 = _x1;
-    x2 = _x2;
+    hshg_call_query(hshg, entity);
   }
-  hshg_cell_t start_x;
-  hshg_cell_t end_x;
-  hshg_cell_t folds = (x2 - (hshg_cell_t)(x1 * hshg->inverse_grid_size) * hshg->grid_size) * hshg->inverse_grid_size;
-  switch(folds) {
-    case 0: {
-      const hshg_cell_t temp = grid_get_cell_(hshg->grids, x1);
-      end_x = grid_get_cell_(hshg->grids, x2);
-      start_x = min(temp, end_x);
-      end_x = max(temp, end_x);
-      break;
-    }
-    case 1: {
-      const hshg_cell_t cell = fabsf(x1) * hshg->grids->inverse_cell_size;
-      if(cell & hshg->grids->cells_side) {
-        start_x = 0;
-        end_x = max(hshg->grids->cells_mask - (cell & hshg->grids->cells_mask), grid_get_cell_(hshg->grids, x2));
-      } else {
-        start_x = min(cell & hshg->grids->cells_mask, grid_get_cell_(hshg->grids, x2));
-        end_x = hshg->grids->cells_mask;
+}
+
+static void hshg_query_cell(struct hshg* const hshg, const struct hshg_grid* const grid, const hshg_cell_sq_t cell, const hshg_pos_t x1, const hshg_pos_t y1, const hshg_pos_t x2, const hshg_pos_t y2, const struct hshg_entity* const giant, const struct hshg_query_to* const to) {
+  const hshg_entity_t head = grid->cells[cell];
+  if(hshg->contiguous) {
+    const struct hshg_entity* const end = hshg->entities + head + grid->counts[cell];
+    for(const struct hshg_entity* entity = hshg->entities + head; entity != end; ++entity) {
+      if(hshg_entity_in_rect(entity, x1, y1, x2, y2)) {
+        hshg_query_found(hshg, giant, to, entity);
       }
-      break;
     }
-    default: {
-      start_x = 0;
-      end_x = hshg->grids->cells_mask;
-      break;
+    return;
+  }
+  for(hshg_entity_t j = head; j != 0;) {
+    const struct hshg_entity* const entity = hshg->entities + j;
+    if(hshg_entity_in_rect(entity, x1, y1, x2, y2)) {
+      hshg_query_found(hshg, giant, to, entity);
     }
+    j = entity->next;
   }
+}
+
+#ifdef HSHG_FIXED
+/* The folded plane repeats every 2 * grid_size, which divides 2^32, so
+folding is done in modular arithmetic */
+#define hshg_fold_t uint32_t
+#else
+#define hshg_fold_t hshg_pos_t
+#endif
+
+#ifndef HSHG_FIXED
+/* How many whole folded planes fit in x, which is not negative */
+static uint32_t hshg_grids_in(const struct hshg* const hshg, const hshg_fold_t x) {
+  return x * hshg->inverse_grid_size;
+}
+#endif
 
-  hshg_pos_t y1;
-  hshg_pos_t y2;
-  if(_y1 < 0) {
-    const hshg_pos_t shift = (((hshg_cell_t)(-_y1 * hshg->inverse_grid_size) << 1) + 2) * hshg->grid_size;
-    y1 = _y1 + shift;
-    y2 = _y2 + shift;
+/* The cell of the first grid that x, which is not negative, falls in
+before the plane is folded */
+static hshg_cell_t grid_fold_cell(const struct hshg_grid* const grid, const hshg_fold_t x) {
+#ifdef HSHG_FIXED
+  return x >> grid->cell_size_log;
+#else
+  return x * grid->inverse_cell_size;
+#endif
+}
+
+static hshg_cell_t grid_get_fold_cell(const struct hshg_grid* const grid, const hshg_fold_t x) {
+  const hshg_cell_t cell = grid_fold_cell(grid, x);
+  if(cell & grid->cells_side) {
+    return grid->cells_mask - (cell & grid->cells_mask);
   } else {
-    y1 = _y1;
-    y2 = _y2;
+    return cell & grid->cells_mask;
   }
-  hshg_cell_t start_y;
-  hshg_cell_t end_y;
-  folds = (y2 - (hshg_cell_t)(y1 * hshg->inverse_grid_size) * hshg->grid_size) * hshg->inverse_grid_size;
-  switch(folds) {
-    case 0: {
-      const hshg_cell_t temp = grid_get_cell_(hshg->grids, y1);
-      end_y = grid_get_cell_(hshg->grids, y2);
-      start_y = min(temp, end_y);
-      end_y = max(temp, end_y);
-      break;
-    }
-    case 1: {
-      const hshg_cell_t cell = fabsf(y1) * hshg->grids->inverse_cell_size;
-      if(cell & hshg->grids->cells_side) {
-        start_y = 0;
-        end_y = max(hshg->grids->cells_mask - (cell & hshg->grids->cells_mask), grid_get_cell_(hshg->grids, y2));
-      } else {
-        start_y = min(cell & hshg->grids->cells_mask, grid_get_cell_(hshg->grids, y2));
-        end_y = hshg->grids->cells_mask;
-      }
-      break;
-    }
-    default: {
-      start_y = 0;
-      end_y = hshg->grids->cells_mask;
-      break;
+}
+
+/* The cells of the first grid that [a, b] covers along one axis */
+static void hshg_query_axis(const struct hshg* const hshg, const hshg_pos_t a, const hshg_pos_t b, hshg_cell_t* const start, hshg_cell_t* const end) {
+  const struct hshg_grid* const grid = hshg->grids;
+#ifdef HSHG_FIXED
+  const hshg_fold_t x1 = (uint32_t) a & (uint32_t)((hshg->grid_size << 1) - 1);
+  const uint32_t len = (uint32_t) b - (uint32_t) a;
+  const hshg_fold_t x2 = x1 + len;
+  /* In 64 bits, since a long range can reach past 2^32 */
+  const uint64_t folds = ((uint64_t)(x1 & (hshg->grid_size - 1)) + len) >> hshg->grid_size_log;
+#else
+  hshg_fold_t x1 = a;
+  hshg_fold_t x2 = b;
+  if(a < 0) {
+    const hshg_pos_t shift = ((hshg_grids_in(hshg, -a) << 1) + 2) * hshg->grid_size;
+    x1 += shift;
+    x2 += shift;
+  }
+  const uint32_t folds = hshg_grids_in(hshg, x2 - hshg_grids_in(hshg, x1) * hshg->grid_size);
+#endif
+  if(folds == 0) {
+    const hshg_cell_t temp = grid_get_fold_cell(grid, x1);
+    const hshg_cell_t cell = grid_get_fold_cell(grid, x2);
+    *start = min(temp, cell);
+    *end = max(temp, cell);
+  } else if(folds == 1) {
+    const hshg_cell_t cell = grid_fold_cell(grid, x1);
+    if(cell & grid->cells_side) {
+      *start = 0;
+      *end = max(grid->cells_mask - (cell & grid->cells_mask), grid_get_fold_cell(grid, x2));
+    } else {
+      *start = min(cell & grid->cells_mask, grid_get_fold_cell(grid, x2));
+      *end = grid->cells_mask;
     }
+  } else {
+    *start = 0;
+    *end = grid->cells_mask;
   }
+}
+
+static void hshg_query_grids(struct hshg* const hshg, const hshg_pos_t _x1, const hshg_pos_t _y1, const hshg_pos_t _x2, const hshg_pos_t _y2, const struct hshg_entity* const giant, const struct hshg_query_to* const to) {
+  /* ^ +y
+     -------------
+     |      x2,y2|
+     |           |
+     |x1,y1      |
+     -------------> +x */
+  hshg_cell_t start_x;
+  hshg_cell_t end_x;
+  hshg_query_axis(hshg, _x1, _x2, &start_x, &end_x);
+  hshg_cell_t start_y;
+  hshg_cell_t end_y;
+  hshg_query_axis(hshg, _y1, _y2, &start_y, &end_y);
 
   const struct hshg_grid* grid = hshg->grids;
   uint8_t i = 0;
@@ -404,14 +1800,25 @@ void hshg_query(const struct hshg* const hshg, const hshg_pos_t _x1, const hshg_
     const hshg_cell_t s_y = start_y != 0 ? start_y - 1 : start_y;
     const hshg_cell_t e_x = end_x != grid->cells_mask ? end_x + 1 : end_x;
     const hshg_cell_t e_y = end_y != grid->cells_mask ? end_y + 1 : end_y;
-    for(hshg_cell_t y = s_y; y <= e_y; ++y) {
-      for(hshg_cell_t x = s_x; x <= e_x; ++x) {
-        for(hshg_entity_t j = grid->cells[(hshg_cell_sq_t) x | (y << grid->cells_log)]; j != 0;) {
-          const struct hshg_entity* const entity = hshg->entities + j;
-          if(entity->x + entity->r >= _x1 && entity->x - entity->r <= _x2 && entity->y + entity->r >= _y1 && entity->y - entity->r <= _y2) {
-            hshg->query(hshg, entity);
+    /* If the rectangle covers more cells than there are used ones, which
+    is usually the case when it spans more than one fold, only go through
+    the used cells instead of every cell in range. */
+    if((hshg_cell_sq_t)(e_x - s_x + 1) * (e_y - s_y + 1) > grid->used) {
+      for(hshg_cell_sq_t u = 0; u < grid->used; ++u) {
+        const hshg_cell_sq_t cell = grid->used_cells[u];
+        const hshg_cell_t x = grid_cell_x(grid, cell);
+        const hshg_cell_t y = grid_cell_y(grid, cell);
+        if(x >= s_x && x <= e_x && y >= s_y && y <= e_y) {
+          hshg_query_cell(hshg, grid, cell, _x1, _y1, _x2, _y2, giant, to);
+        }
+      }
+    } else {
+      for(hshg_cell_t y = s_y; y <= e_y; ++y) {
+        for(hshg_cell_t x = s_x; x <= e_x; ++x) {
+          const hshg_cell_sq_t cell = grid_cell(grid, x, y);
+          if(grid_is_used(grid, cell)) {
+            hshg_query_cell(hshg, grid, cell, _x1, _y1, _x2, _y2, giant, to);
           }
-          j = entity->next;
         }
       }
     }
@@ -424,5 +1831,69 @@ void hshg_query(const struct hshg* const hshg, const hshg_pos_t _x1, const hshg_
   }
 }
 
+static void hshg_query_all(const struct hshg* const hshg, const hshg_pos_t x1, const hshg_pos_t y1, const hshg_pos_t x2, const hshg_pos_t y2, const struct hshg_query_to* const to) {
+  /* Without a giant, hshg_query_grids() only reads */
+  hshg_query_grids((struct hshg*) hshg, x1, y1, x2, y2, NULL, to);
+  for(hshg_entity_t i = hshg->giants; i != 0;) {
+    const struct hshg_entity* const entity = hshg->entities + i;
+    if(hshg_entity_in_rect(entity, x1, y1, x2, y2)) {
+      hshg_query_found((struct hshg*) hshg, NULL, to, entity);
+    }
+    i = entity->next;
+  }
+}
+
+void hshg_query(const struct hshg* const hshg, const hshg_pos_t x1, const hshg_pos_t y1, const hshg_pos_t x2, const hshg_pos_t y2) {
+  hshg_query_all(hshg, x1, y1, x2, y2, &(struct hshg_query_to){0});
+}
+
+/* Like hshg_query(), but hands the entities and data to the given callback
+instead, so that threads querying the same HSHG can each collect their own
+results */
+void hshg_query_with(const struct hshg* const hshg, const hshg_pos_t x1, const hshg_pos_t y1, const hshg_pos_t x2, const hshg_pos_t y2, void (*query)(const struct hshg*, const struct hshg_entity*, void*), void* const data) {
+  assert(query != NULL);
+  hshg_query_all(hshg, x1, y1, x2, y2, &(struct hshg_query_to){ .query = query, .data = data });
+}
+
+/* Giants are paired with each other, and then with everything in the grids
+under their actual AABB, widened by the skin. With ccd, that is the AABB
+covering their movement over the last frame. */
+static void hshg_collide_giants(struct hshg* const hshg) {
+  for(hshg_entity_t i = hshg->giants; i != 0;) {
+    const struct hshg_entity* const entity = hshg->entities + i;
+    for(hshg_entity_t j = entity->next; j != 0;) {
+      const struct hshg_entity* const ent = hshg->entities + j;
+      j = ent->next;
+#ifdef HSHG_VELOCITY
+      if(hshg->ccd) {
+        hshg_collide_swept(hshg, entity, ent, entity->vx - ent->vx, entity->vy - ent->vy);
+        continue;
+      }
+#endif
+      hshg_collide_pair(hshg, entity, ent);
+    }
+    const hshg_pos_t w = entity->w + hshg->skin;
+    const hshg_pos_t h = entity->h + hshg->skin;
+    i = entity->next;
+#ifdef HSHG_VELOCITY
+    if(hshg->ccd) {
+      const hshg_pos_t x = entity->x - entity->vx;
+      const hshg_pos_t y = entity->y - entity->vy;
+      hshg_query_grids(hshg, min(x, entity->x) - w, min(y, entity->y) - h, max(x, entity->x) + w, max(y, entity->y) + h, entity, NULL);
+      continue;
+    }
+#endif
+    hshg_query_grids(hshg, entity->x - w, entity->y - h, entity->x + w, entity->y + h, entity, NULL);
+  }
+}
+
 #undef max
 #undef min
+
+#undef hshg_fold_t
+#undef hshg_half
+#undef hshg_abs
+#undef hshg_call_query
+#undef hshg_call_collide
+#undef hshg_has_collide
+#undef hshg_call_update
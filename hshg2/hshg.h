@@ -3,6 +3,46 @@
 
 #include <stdint.h>
 
+#ifdef HSHG_THREADS
+#include <pthread.h>
+#endif
+
+/* Define HSHG_MORTON when compiling hshg.c to index cells in Z-order. */
+
+/* Define HSHG_THREADS wherever this header is included to get
+hshg_collide_parallel() and its thread pool, which need pthreads. */
+
+/* Define HSHG_VELOCITY wherever this header is included to give every entity
+vx and vy, which are needed for ccd, hshg_integrate(), hshg_respond() and
+hshg_apply(). Without it, these aren't there, and entities are 8 bytes
+smaller. */
+
+/* Define hshg_payload_t to a type, or HSHG_PAYLOAD to a number of bytes,
+wherever this header is included to give every entity a payload of that
+size. It is moved together with the entity, so that callbacks find their
+data right next to it instead of behind ref. A type is only seen by hshg.c
+if it's included, or if the type is visible from the command line. */
+
+/* Define HSHG_FIXED wherever this header is included to make positions
+int32_t in units of the user's choosing. Cell sizes must then be powers of two,
+so that finding cells is only shifts and masks, and results come out the same
+on every compiler and machine. Only loose and toi stay floats. Differences of
+positions and of velocities must fit in an int32_t, so positions are best
+kept within +-2^30. The side of the grid times its cell size must fit in 32
+bits, so with 16 bits of fraction, 512 cells of 128.0 are already too many. */
+
+/* hshg.c can also be included right into a file, with any of HSHG_UPDATE,
+HSHG_COLLIDE and HSHG_QUERY defined to functions taking the same arguments
+as the callbacks they replace. These are then called directly instead of
+through the pointers in struct hshg, so the compiler can inline them into
+the loops. Defining HSHG_STATIC before the first include of this header
+gives the file its own, static copy of the functions below. */
+#ifdef HSHG_STATIC
+#define HSHG_API static inline
+#else
+#define HSHG_API extern
+#endif
+
 #ifndef hshg_entity_t
 #define hshg_entity_t  uint32_t
 #endif
@@ -16,8 +56,12 @@
 #endif
 
 #ifndef hshg_pos_t
+#ifdef HSHG_FIXED
+#define hshg_pos_t     int32_t
+#else
 #define hshg_pos_t     float
 #endif
+#endif
 
 #define max_t(t) (((0x1ULL << ((sizeof(t) << 3ULL) - 1ULL)) - 1ULL) | (0xFULL << ((sizeof(t) << 3ULL) - 4ULL)))
 
@@ -25,6 +69,10 @@
 #define hshg_cell_max    ((hshg_cell_t)    max_t(hshg_cell_t)   )
 #define hshg_cell_sq_max ((hshg_cell_sq_t) max_t(hshg_cell_sq_t))
 
+/* The grid of entities too large for even the topmost grid, and of the ones
+swept because of ccd */
+#define hshg_grid_giant  UINT8_MAX
+
 struct hshg_entity {
   hshg_cell_sq_t cell;
   uint8_t grid;
@@ -33,58 +81,267 @@ struct hshg_entity {
   hshg_entity_t ref;
   hshg_pos_t x;
   hshg_pos_t y;
-  hshg_pos_t r;
+  /* Half of the width and height. Circles have both equal to the radius. */
+  hshg_pos_t w;
+  hshg_pos_t h;
+#ifdef HSHG_VELOCITY
+  /* Movement since the last frame, used with ccd and by hshg_integrate() */
+  hshg_pos_t vx;
+  hshg_pos_t vy;
+#endif
+#if defined(hshg_payload_t)
+  hshg_payload_t payload;
+#elif defined(HSHG_PAYLOAD)
+  _Alignas(8) uint8_t payload[HSHG_PAYLOAD];
+#endif
 };
 
 struct hshg_grid {
   hshg_entity_t* cells;
+  hshg_entity_t* counts;
+  uint64_t* bitmap;
+  hshg_cell_sq_t* used_cells;
+  hshg_cell_sq_t* used_idx;
+  
+  hshg_cell_sq_t used;
+  hshg_cell_sq_t used_size;
+  hshg_entity_t entities_len;
   
   hshg_cell_t cells_side;
   hshg_cell_t cells_mask;
   uint8_t cells_log;
   
   uint32_t cell_size;
+#ifdef HSHG_FIXED
+  uint8_t cell_size_log;
+#else
   hshg_pos_t inverse_cell_size;
+#endif
+  hshg_pos_t margin;
+};
+
+struct hshg_pair {
+  hshg_entity_t a;
+  hshg_entity_t b;
+};
+
+struct hshg_sweep {
+  hshg_pos_t min;
+  hshg_pos_t max;
+  const struct hshg_entity* entity;
+};
+
+/* An entity's AABB in units of a power of two, wrapping around at 16 bits.
+The minimums are negated. */
+struct hshg_bounds {
+  uint16_t min_x;
+  uint16_t min_y;
+  uint16_t max_x;
+  uint16_t max_y;
 };
 
 struct hshg {
   struct hshg_entity* entities;
   struct hshg_grid* grids;
+  hshg_entity_t* cells;
+  hshg_entity_t* counts;
+  uint64_t* bitmap;
+  hshg_cell_sq_t* used_idx;
+  struct hshg_pair* pairs;
+  hshg_pos_t* pairs_pos;
+  struct hshg_sweep* sweep;
+  hshg_entity_t* moved;
+  struct hshg_bounds* bounds;
   
   void (*update)(struct hshg*, hshg_entity_t);
+  /* If NULL, hshg_collide() only keeps the pairs for hshg_respond() */
   void (*collide)(const struct hshg*, const struct hshg_entity*, const struct hshg_entity*);
   void (*query)(const struct hshg*, const struct hshg_entity*);
   
   uint8_t cell_div_log;
   uint8_t cell_log;
+  /* Set before hshg_init() to skip relinking in hshg_move() and instead
+  sort all entities by their cells in hshg_update(). Pays off when almost
+  every entity changes its cell every frame. */
+  uint8_t rebuild;
+  /* Set while every cell's entities sit next to each other in the entities
+  array, which is after hshg_optimize() or hshg_rebuild() up until the next
+  insertion, removal or relinking. */
+  uint8_t contiguous;
+  
+  /* Set before hshg_init() to a fraction of a cell's size below 0.5 to let
+  entities stray that far out of their cell before hshg_move() relinks them.
+  To keep the neighbourhoods the same, entities are put on grids as if they
+  were 1 / (1 - 2 * loose) times larger. */
+  float loose;
+  
+  /* Set before hshg_init() to make hshg_collide() remember every pair that
+  is closer than skin on top of both extents, and to only go through these on
+  later calls, until an entity moves more than skin / 2 away from where it
+  was, or entities are inserted, removed, resized or reordered. Entities are
+  put on grids as if they were skin / 2 larger. */
+  hshg_pos_t skin;
+  uint8_t pairs_valid;
+  uint32_t pairs_len;
+  uint32_t pairs_size;
+  
+  /* Cells with more entities than this are sorted along the x axis and swept
+  in hshg_collide() instead of checking every pair of their entities. 0 at
+  hshg_init() means 32. */
+  hshg_entity_t crowded;
+  hshg_entity_t sweep_size;
+  
+  /* Set to make hshg_collide() first copy the bounds of all entities into a
+  packed array while the HSHG is contiguous, and only load entities whose
+  packed bounds overlap. That's 8 bytes to go through per pair instead of a
+  whole entity, 4 pairs at a time with AVX2. */
+  uint8_t quantize;
+  hshg_entity_t bounds_size;
+  
+  /* Set before hshg_init() to sweep entities that moved by more than their
+  own size in the last frame, as told by vx and vy, from where they were to
+  where they are, so that they can't pass through anything. While their pair
+  is handed to the collide callback, toi is the part of the frame that passed
+  before they started overlapping. It is 1 for all other pairs. */
+#ifdef HSHG_VELOCITY
+  uint8_t ccd;
+  float toi;
+#endif
+  
   uint8_t grids_len;
+  uint8_t grids_size;
+  /* Head of the list of entities on hshg_grid_giant */
+  hshg_entity_t giants;
   
   hshg_cell_sq_t grid_size;
+#ifdef HSHG_FIXED
+  uint8_t grid_size_log;
+#else
   hshg_pos_t inverse_grid_size;
+#endif
 
   hshg_entity_t free_entity;
   hshg_entity_t entities_used;
   hshg_entity_t entities_size;
+  hshg_entity_t moved_size;
+};
+
+/* Snapshots of an HSHG published by one writer thread for any number of
+reader threads to query without locks. A reader never sees a snapshot
+while it's written, and the writer never waits for readers. Zero it before
+the first use. Snapshots keep the query callback of the published HSHG, which
+all readers then share, so readers are best served by hshg_query_with() and
+their own callback and data. */
+struct hshg_shared {
+  struct hshg shots[3];
+  /* 1 + the index of the last published snapshot, 0 before the first one */
+  uint8_t latest;
+  uint32_t readers[3];
 };
 
-extern int  hshg_init(struct hshg* const, const hshg_cell_t, const uint32_t);
+/* Where hshg_collide_step() left off. Zero it to start a new pass. */
+struct hshg_cursor {
+  uint32_t pairs;
+  hshg_cell_sq_t used;
+  uint8_t grid;
+  uint8_t top;
+  uint8_t state;
+};
+
+/* Insertions and removals queued up by one thread, for hshg_commit() to
+apply on the thread that owns the HSHG. Every thread fills its own stage,
+so there are no locks, and the HSHG can be used meanwhile. Zero it before
+the first use. */
+struct hshg_stage {
+  struct hshg_entity* inserts;
+  hshg_entity_t* removes;
+  hshg_entity_t inserts_len;
+  hshg_entity_t inserts_size;
+  hshg_entity_t removes_len;
+  hshg_entity_t removes_size;
+};
+
+#ifdef HSHG_THREADS
+struct hshg_worker;
+struct hshg_task;
+
+/* Threads for hshg_collide_parallel(), started once by hshg_pool_init() and
+kept waiting in between calls. A pool runs one call at a time, on any HSHG. */
+struct hshg_pool {
+  struct hshg_worker* workers;
+  struct hshg_task* tasks;
+  uint32_t tasks_size;
+  uint32_t threads;
+  
+  pthread_mutex_t mutex;
+  pthread_cond_t start;
+  pthread_cond_t done;
+  uint32_t round;
+  uint32_t running;
+  uint8_t stop;
+};
+#endif
+
+HSHG_API int  hshg_init(struct hshg* const, const hshg_cell_t, const uint32_t);
+
+HSHG_API void hshg_free(struct hshg* const);
+
+HSHG_API void hshg_insert(struct hshg* const, const struct hshg_entity* const);
+
+HSHG_API void hshg_remove(struct hshg* const, const hshg_entity_t);
+
+HSHG_API void hshg_stage_insert(struct hshg_stage* const, const struct hshg_entity* const);
+
+HSHG_API void hshg_stage_remove(struct hshg_stage* const, const hshg_entity_t);
+
+HSHG_API void hshg_commit(struct hshg* const, struct hshg_stage* const, const uint32_t);
+
+HSHG_API void hshg_stage_free(struct hshg_stage* const);
+
+HSHG_API void hshg_move(struct hshg* const, const hshg_entity_t);
+
+HSHG_API void hshg_resize(struct hshg* const, const hshg_entity_t);
+
+HSHG_API void hshg_update(struct hshg* const);
+
+#ifdef HSHG_VELOCITY
+HSHG_API void hshg_integrate(struct hshg* const, const hshg_pos_t, const hshg_pos_t, const hshg_pos_t, const hshg_pos_t);
+#endif
+
+HSHG_API void hshg_collide(struct hshg* const);
+
+HSHG_API int  hshg_collide_step(struct hshg* const, const uint64_t, struct hshg_cursor* const);
+
+#ifdef HSHG_THREADS
+HSHG_API int  hshg_pool_init(struct hshg_pool* const, const uint32_t);
+
+HSHG_API void hshg_collide_parallel(struct hshg* const, struct hshg_pool* const);
+
+HSHG_API void hshg_pool_free(struct hshg_pool* const);
+#endif
+
+#ifdef HSHG_VELOCITY
+HSHG_API void hshg_respond(const struct hshg* const, uint32_t, const uint32_t, hshg_pos_t* const);
+
+HSHG_API void hshg_apply(struct hshg* const, const hshg_pos_t* const);
+#endif
 
-extern void hshg_free(struct hshg* const);
+HSHG_API void hshg_optimize(struct hshg* const);
 
-extern void hshg_insert(struct hshg* const, const struct hshg_entity* const);
+HSHG_API void hshg_rebuild(struct hshg* const);
 
-extern void hshg_remove(struct hshg* const, const hshg_entity_t);
+HSHG_API void hshg_snapshot(struct hshg* const, const struct hshg* const);
 
-extern void hshg_move(const struct hshg* const, const hshg_entity_t);
+HSHG_API int  hshg_publish(struct hshg_shared* const, const struct hshg* const);
 
-extern void hshg_resize(struct hshg* const, const hshg_entity_t);
+HSHG_API const struct hshg* hshg_acquire(struct hshg_shared* const);
 
-extern void hshg_update(struct hshg* const);
+HSHG_API void hshg_release(struct hshg_shared* const, const struct hshg* const);
 
-extern void hshg_collide(const struct hshg* const);
+HSHG_API void hshg_shared_free(struct hshg_shared* const);
 
-extern void hshg_optimize(struct hshg* const);
+HSHG_API void hshg_query(const struct hshg* const, hshg_pos_t, hshg_pos_t, hshg_pos_t, hshg_pos_t);
 
-extern void hshg_query(const struct hshg* const, hshg_pos_t, hshg_pos_t, hshg_pos_t, hshg_pos_t);
+HSHG_API void hshg_query_with(const struct hshg* const, hshg_pos_t, hshg_pos_t, hshg_pos_t, hshg_pos_t, void (*)(const struct hshg*, const struct hshg_entity*, void*), void* const);
 
 #endif // _hshg_h_
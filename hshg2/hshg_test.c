@@ -1,6 +1,17 @@
 #define TEST_NO_ERR_HANDLER
 #include <shnet/test.h>
 
+/* Include hshg.c below, with update(), collide() and query() inlined */
+#ifndef INLINE
+#define INLINE 0
+#endif
+
+#if INLINE == 1
+#define HSHG_STATIC
+#define HSHG_UPDATE update
+#define HSHG_QUERY query
+#endif
+
 #include "hshg.h"
 
 #include <shnet/time.h>
@@ -10,18 +21,91 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <string.h>
+#include <pthread.h>
 
+#ifndef AGENTS_NUM
 #define AGENTS_NUM 50000
+#endif
 
+#ifndef CELLS_SIDE
 #define CELLS_SIDE 512
+#endif
 #define AGENT_R 7
+#ifndef CELL_SIZE
 #define CELL_SIZE 128
+#endif
+#ifndef ARENA_WIDTH
 #define ARENA_WIDTH 22500
+#endif
+#ifndef ARENA_HEIGHT
 #define ARENA_HEIGHT 22500
+#endif
 
 #define LATENCY_NUM 20
 
+#ifndef SINGLE_LAYER
 #define SINGLE_LAYER 0
+#endif
+
+#ifndef REBUILD
+#define REBUILD 0
+#endif
+
+#ifndef OPTIMIZE
+#define OPTIMIZE 1
+#endif
+
+#ifndef LOOSE
+#define LOOSE 0
+#endif
+
+#ifndef SKIN
+#define SKIN 0
+#endif
+
+#ifndef QUANTIZE
+#define QUANTIZE 0
+#endif
+
+/* Move entities with hshg_integrate() instead of hshg_update(). Requires
+building with HSHG_VELOCITY. */
+#ifndef INTEGRATE
+#define INTEGRATE 0
+#endif
+
+#if INTEGRATE == 1 && !defined(HSHG_VELOCITY)
+#error INTEGRATE requires HSHG_VELOCITY
+#endif
+
+/* Bounce entities off each other with hshg_respond() instead of collide().
+Requires INTEGRATE. */
+#ifndef RESPOND
+#define RESPOND 0
+#endif
+
+/* Collide and query a snapshot of the last frame on another thread while
+the next one is being updated. Requires RESPOND 0. */
+#ifndef PIPELINE
+#define PIPELINE 0
+#endif
+
+#if PIPELINE == 1 && RESPOND == 1
+#error PIPELINE requires RESPOND 0
+#endif
+
+/* Collide on this many threads with hshg_collide_parallel(). Requires
+RESPOND, since collide() isn't thread-safe, and building with HSHG_THREADS. */
+#ifndef THREADS
+#define THREADS 1
+#endif
+
+#if THREADS > 1 && (RESPOND == 0 || !defined(HSHG_THREADS))
+#error THREADS requires RESPOND and HSHG_THREADS
+#endif
+
+#if INLINE == 1 && RESPOND == 0
+#define HSHG_COLLIDE collide
+#endif
 
 struct ball {
   float vx;
@@ -30,20 +114,39 @@ struct ball {
 
 struct ball balls[AGENTS_NUM];
 
+/* Build with HSHG_PAYLOAD=8 to keep the balls inside of the entities */
+#ifdef HSHG_PAYLOAD
+#define BALL(entity) (*(struct ball*) (entity)->payload)
+#else
+#define BALL(entity) balls[(entity)->ref]
+#endif
+
+/* Where collide() adds velocity to. While pipelined, that's pushes[], added
+to the entities after the frame, since the snapshot is thrown away. */
+#if PIPELINE == 1
+struct ball pushes[AGENTS_NUM];
+
+#define PUSH(entity) pushes[(entity)->ref]
+#elif INTEGRATE == 1
+#define PUSH(entity) (*(entity))
+#else
+#define PUSH(entity) BALL(entity)
+#endif
+
 void update(struct hshg* hshg, hshg_entity_t x) {
   struct hshg_entity* const a = hshg->entities + x;
-  a->x += balls[a->ref].vx;
-	if(a->x < a->r) {
-		++balls[a->ref].vx;
-	} else if(a->x + a->r >= ARENA_WIDTH) {
-		--balls[a->ref].vx;
+  a->x += BALL(a).vx;
+	if(a->x < a->w) {
+		++BALL(a).vx;
+	} else if(a->x + a->w >= ARENA_WIDTH) {
+		--BALL(a).vx;
 	}
   
-	a->y += balls[a->ref].vy;
-	if(a->y < a->r) {
-		++balls[a->ref].vy;
-	} else if(a->y + a->r >= ARENA_HEIGHT) {
-		--balls[a->ref].vy;
+	a->y += BALL(a).vy;
+	if(a->y < a->h) {
+		++BALL(a).vy;
+	} else if(a->y + a->h >= ARENA_HEIGHT) {
+		--BALL(a).vy;
 	}
   
   hshg_move(hshg, x);
@@ -58,13 +161,15 @@ void collide(const struct hshg* hshg, const struct hshg_entity* a, const struct
   const float yd = a->y - b->y;
   const float d = xd * xd + yd * yd;
   ++maybe_collisions;
-  if(d <= (a->r + b->r) * (a->r + b->r)) {
+  if(d <= (a->w + b->w) * (a->w + b->w)) {
     ++collisions;
     const float angle = atan2f(yd, xd);
-    balls[a->ref].vx += cosf(angle);
-    balls[a->ref].vy += sinf(angle);
-    balls[b->ref].vx -= cosf(angle);
-    balls[b->ref].vy -= sinf(angle);
+    struct hshg_entity* const ea = hshg->entities + (a - hshg->entities);
+    struct hshg_entity* const eb = hshg->entities + (b - hshg->entities);
+    PUSH(ea).vx += cosf(angle);
+    PUSH(ea).vy += sinf(angle);
+    PUSH(eb).vx -= cosf(angle);
+    PUSH(eb).vy -= sinf(angle);
   }
 }
 
@@ -74,6 +179,34 @@ void query(const struct hshg* hshg, const struct hshg_entity* a) {
   ++queries;
 }
 
+#if INLINE == 1
+#include "hshg.c"
+#endif
+
+void queries_run(const struct hshg* hshg) {
+  for(int x = 0; x < 10; ++x) {
+    for(int y = 0; y < 10; ++y) {
+      hshg_query(hshg, x * 1920, y * 1080, (x + 1) * 1920, (y + 1) * 1080);
+    }
+  }
+}
+
+#if PIPELINE == 1
+uint64_t shot_col;
+uint64_t shot_qry;
+
+void* collide_snapshot(void* data) {
+  struct hshg* const shot = data;
+  const uint64_t col_time = time_get_time();
+  hshg_collide(shot);
+  const uint64_t qry_time = time_get_time();
+  queries_run(shot);
+  shot_col = qry_time - col_time;
+  shot_qry = time_get_time() - qry_time;
+  return NULL;
+}
+#endif
+
 int main() {
   srand(time_get_time());
   struct hshg hshg = {0};
@@ -81,10 +214,23 @@ int main() {
   test_begin("hshg benchmark");
   puts("");
   hshg.update = update;
+#if RESPOND == 1
+  hshg_pos_t* const deltas = malloc(sizeof(*deltas) * (AGENTS_NUM + 1) * 2);
+  assert(deltas);
+#else
   hshg.collide = collide;
+#endif
   hshg.query = query;
   hshg.entities_size = AGENTS_NUM;
+  hshg.rebuild = REBUILD;
+  hshg.loose = LOOSE;
+  hshg.skin = SKIN;
+  hshg.quantize = QUANTIZE;
   assert(!hshg_init(&hshg, CELLS_SIDE, CELL_SIZE));
+#if THREADS > 1
+  struct hshg_pool pool;
+  assert(!hshg_pool_init(&pool, THREADS));
+#endif
 
   uint64_t ins_time = time_get_time();
   for(hshg_entity_t i = 0; i < AGENTS_NUM; ++i) {
@@ -99,42 +245,93 @@ int main() {
 #else
     float min_r = AGENT_R;
 #endif
-    hshg_insert(&hshg, &((struct hshg_entity) {
+    balls[i].vx = ((float) rand() / RAND_MAX) * 8 - 4;
+    balls[i].vy = ((float) rand() / RAND_MAX) * 8 - 4;
+    struct hshg_entity entity = {
       .x = ((float) rand() / RAND_MAX) * ARENA_WIDTH,
       .y = ((float) rand() / RAND_MAX) * ARENA_HEIGHT,
-      .r = min_r,
+      .w = min_r,
+      .h = min_r,
       .ref = i
-    }));
-    balls[i].vx = ((float) rand() / RAND_MAX) * 8 - 4;
-    balls[i].vy = ((float) rand() / RAND_MAX) * 8 - 4;
+    };
+#ifdef HSHG_VELOCITY
+    entity.vx = balls[i].vx;
+    entity.vy = balls[i].vy;
+#endif
+#ifdef HSHG_PAYLOAD
+    BALL(&entity) = balls[i];
+#endif
+    hshg_insert(&hshg, &entity);
   }
   uint64_t ins_end_time = time_get_time();
   printf("took %lu ms to insert %d entities\n%u grids\n\n", time_ns_to_ms(ins_end_time - ins_time), AGENTS_NUM, hshg.grids_len);
+#if PIPELINE == 1
+  struct hshg shot = {0};
+  hshg_snapshot(&shot, &hshg);
+#endif
   
   double upd[LATENCY_NUM];
   double opt[LATENCY_NUM];
   double col[LATENCY_NUM];
   double qry[LATENCY_NUM];
+  double all[LATENCY_NUM];
   int i = 0;
   while(1) {
+#if PIPELINE == 1
+    pthread_t thread;
+    assert(!pthread_create(&thread, NULL, collide_snapshot, &shot));
+#endif
     const uint64_t upd_time = time_get_time();
+#if INTEGRATE == 1
+    hshg_integrate(&hshg, 0, 0, ARENA_WIDTH, ARENA_HEIGHT);
+#else
     hshg_update(&hshg);
+#endif
     const uint64_t opt_time = time_get_time();
+#if REBUILD == 0 && OPTIMIZE == 1
     hshg_optimize(&hshg);
+#endif
     const uint64_t col_time = time_get_time();
+#if PIPELINE == 1
+    assert(!pthread_join(thread, NULL));
+    for(hshg_entity_t j = 1; j < hshg.entities_used; ++j) {
+      struct hshg_entity* const entity = hshg.entities + j;
+      if(entity->cell == hshg_cell_sq_max) continue;
+#if INTEGRATE == 1
+      entity->vx += pushes[entity->ref].vx;
+      entity->vy += pushes[entity->ref].vy;
+#else
+      BALL(entity).vx += pushes[entity->ref].vx;
+      BALL(entity).vy += pushes[entity->ref].vy;
+#endif
+    }
+    memset(pushes, 0, sizeof(pushes));
+    hshg_snapshot(&shot, &hshg);
+    const uint64_t end_time = time_get_time();
+
+    col[i] = (double) shot_col / 1000000.0;
+    qry[i] = (double) shot_qry / 1000000.0;
+#else
+#if THREADS > 1
+    hshg_collide_parallel(&hshg, &pool);
+#else
     hshg_collide(&hshg);
+#endif
+#if RESPOND == 1
+    memset(deltas, 0, sizeof(*deltas) * hshg.entities_used * 2);
+    hshg_respond(&hshg, 0, hshg.pairs_len, deltas);
+    hshg_apply(&hshg, deltas);
+#endif
     const uint64_t qry_time = time_get_time();
-    for(int x = 0; x < 10; ++x) {
-      for(int y = 0; y < 10; ++y) {
-        hshg_query(&hshg, x * 1920, y * 1080, (x + 1) * 1920, (y + 1) * 1080);
-      }
-    }
+    queries_run(&hshg);
     const uint64_t end_time = time_get_time();
 
-    upd[i] = (double)(opt_time - upd_time) / 1000000.0;
-    opt[i] = (double)(col_time - opt_time) / 1000000.0;
     col[i] = (double)(qry_time - col_time) / 1000000.0;
     qry[i] = (double)(end_time - qry_time) / 1000000.0;
+#endif
+    upd[i] = (double)(opt_time - upd_time) / 1000000.0;
+    opt[i] = (double)(col_time - opt_time) / 1000000.0;
+    all[i] = (double)(end_time - upd_time) / 1000000.0;
 
     if(i + 1 == LATENCY_NUM) {
       double upd_avg = 0;
@@ -160,9 +357,15 @@ int main() {
         qry_avg += qry[i];
       }
       qry_avg /= LATENCY_NUM;
+
+      double all_avg = 0;
+      for(int i = 0; i < LATENCY_NUM; ++i) {
+        all_avg += all[i];
+      }
+      all_avg /= LATENCY_NUM;
       
       printf("upd %.2lf ms\nopt %.2lf ms\ncol %.2lf ms\nqry %.2lf ms\nall %.2lf ms\nattempted collisions %lu\nsucceeded collisions %lu\nqueried entities %lu\n",
-        upd_avg, opt_avg, col_avg, qry_avg, upd_avg + opt_avg + col_avg + qry_avg, maybe_collisions, collisions, queries);
+        upd_avg, opt_avg, col_avg, qry_avg, all_avg, maybe_collisions, collisions, queries);
 
       maybe_collisions = 0;
       collisions = 0;
@@ -1,17 +1,712 @@
 #include "hshg.h"
 
+#include <math.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
+/* Checks hshg_collide() and hshg_query() against brute force on a random
+scene of small, elongated, large and giant entities, with a crowded spot,
+moving, being removed and reinserted between frames. Build it together with
+hshg.c using the same defines as for the benchmark to check other modes, and
+with HSHG_MORTON or HSHG_FIXED to check those. */
+
+#ifndef ENTITIES_NUM
+#define ENTITIES_NUM 4000
+#endif
+
+#ifndef FRAMES
+#define FRAMES 6
+#endif
+
+#ifndef SEED
+#define SEED 1234
+#endif
+
+/* Every this many entities is a giant one */
+#ifndef GIANTS
+#define GIANTS 997
+#endif
+
+#ifndef CELLS_SIDE
+#define CELLS_SIDE 128
+#endif
+
+#ifndef OPTIMIZE
+#define OPTIMIZE 0
+#endif
+
+#ifndef REBUILD
+#define REBUILD 0
+#endif
+
+#ifndef LOOSE
+#define LOOSE 0
+#endif
+
+#ifndef SKIN
+#define SKIN 0
+#endif
+
+#ifndef QUANTIZE
+#define QUANTIZE 0
+#endif
+
+/* 0 means the default */
+#ifndef CROWDED
+#define CROWDED 0
+#endif
+
+/* Collide with hshg_collide_step() and a budget of this many ns */
+#ifndef STEP
+#define STEP -1
+#endif
+
+/* Collide with hshg_collide_parallel() on this many threads */
+#ifndef THREADS
+#define THREADS 0
+#endif
+
+#if THREADS > 0 && !defined(HSHG_THREADS)
+#error THREADS requires HSHG_THREADS
+#endif
+
+/* Move entities with hshg_integrate() instead of hshg_update(), and check
+where it moved them */
+#ifndef INTEGRATE
+#define INTEGRATE 0
+#endif
+
+#if INTEGRATE == 1 && !defined(HSHG_VELOCITY)
+#error INTEGRATE requires HSHG_VELOCITY
+#endif
+
+/* Sweep fast entities, and check pairs along their movement and toi */
+#ifndef CCD
+#define CCD 0
+#endif
+
+#if CCD == 1 && !defined(HSHG_VELOCITY)
+#error CCD requires HSHG_VELOCITY
+#endif
+
+/* Leave the pairs to the HSHG instead of a callback, and check the velocities
+after hshg_respond() and hshg_apply() against a response computed per pair */
+#ifndef RESPOND
+#define RESPOND 0
+#endif
+
+#if RESPOND == 1 && !defined(HSHG_VELOCITY)
+#error RESPOND requires HSHG_VELOCITY
+#endif
+
+/* Collide and query on a snapshot, while the HSHG already moves on to the
+next frame */
+#ifndef SNAPSHOT
+#define SNAPSHOT 0
+#endif
+
+#if SNAPSHOT == 1 && INTEGRATE == 1
+#error SNAPSHOT does not go with INTEGRATE, which moves the bodies ahead
+#endif
+
+/* Stage the removals and insertions of frame 3 on this many threads, each
+removal on two of them, and commit them after */
+#ifndef STAGE
+#define STAGE 0
+#endif
+
+/* Publish the HSHG every frame for this many threads, which query it and
+check what they find against the snapshot they acquired */
+#ifndef SHARED
+#define SHARED 0
+#endif
+
+/* Fixed-point positions get 4 bits of fraction, and cells a power of two */
+#ifndef UNIT
+#ifdef HSHG_FIXED
+#define UNIT 16
+#else
+#define UNIT 1
+#endif
+#endif
+
+#ifndef CELL_SIZE
+#define CELL_SIZE (16 * UNIT)
+#endif
+
+/* Where the scene is centred, in the units of hshg_pos_t */
+#ifndef ORIGIN
+#define ORIGIN 0
+#endif
+
+struct body {
+  hshg_pos_t x;
+  hshg_pos_t y;
+  hshg_pos_t w;
+  hshg_pos_t h;
+  hshg_pos_t vx;
+  hshg_pos_t vy;
+  int alive;
+  /* On hshg_grid_giant, so swept along its velocity with ccd */
+  int swept;
+};
+
+struct body bodies[ENTITIES_NUM];
+
+uint64_t* pairs;
+uint64_t pairs_len;
+uint64_t pairs_size;
+
+uint32_t hits[ENTITIES_NUM];
+
+#if THREADS > 0 || SHARED > 0 || STAGE > 0
+#include <pthread.h>
+#endif
+
+#if THREADS > 0
+pthread_mutex_t pairs_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
 int error_handler(int e, int c) {
   (void) c;
   if(e == EINTR || e == 0) return 0;
   return -1;
 }
 
+static inline hshg_pos_t pos_abs(const hshg_pos_t x) {
+  return x < 0 ? -x : x;
+}
+
+static hshg_pos_t rnd(const float min, const float max) {
+  return (hshg_pos_t)((min + (max - min) * ((float) rand() / RAND_MAX)) * UNIT);
+}
+
+static hshg_pos_t rnd_at(const float min, const float max) {
+  return rnd(min, max) + ORIGIN;
+}
+
+#if INTEGRATE == 1
+/* Walls of hshg_integrate() */
+static const hshg_pos_t wall_x1 = -3000 * UNIT + ORIGIN;
+static const hshg_pos_t wall_x2 = 3000 * UNIT + ORIGIN;
+
+/* What hshg_integrate() does to an entity */
+static void bounce(hshg_pos_t* const x, hshg_pos_t* const v, const hshg_pos_t w) {
+  *x += *v;
+  if(*x < wall_x1 + w) {
+    *v = pos_abs(*v);
+  }
+  if(*x + w >= wall_x2) {
+    *v = -pos_abs(*v);
+  }
+}
+#endif
+
+#if CCD == 1
+/* Narrows [lo, hi] down to how many frames ago intervals that are d apart
+now, move apart by v per frame and extend e together overlapped */
+static void sweep_axis(const double d, const double v, const double e, double* const lo, double* const hi) {
+  if(v == 0) {
+    if(d > e || d < -e) {
+      *lo = 2;
+    }
+    return;
+  }
+  const double s1 = (d - e) / v;
+  const double s2 = (d + e) / v;
+  *lo = fmax(*lo, fmin(s1, s2));
+  *hi = fmin(*hi, fmax(s1, s2));
+}
+
+/* Whether two entities, widened together by skin, overlapped at any point
+of the last frame, with the ones on the giants' list moving along their
+velocity and the others standing still. If so, hi is how long ago they
+started to. */
+static int touch_since(const struct body* const a, const struct body* const b, const double skin, double* const hi) {
+  const double vx = (a->swept ? a->vx : 0) - (double)(b->swept ? b->vx : 0);
+  const double vy = (a->swept ? a->vy : 0) - (double)(b->swept ? b->vy : 0);
+  double lo = 0;
+  *hi = 1;
+  sweep_axis((double) a->x - b->x, vx, (double) a->w + b->w + skin, &lo, hi);
+  sweep_axis((double) a->y - b->y, vy, (double) a->h + b->h + skin, &lo, hi);
+  return lo <= *hi;
+}
+
+static int touch(const struct body* const a, const struct body* const b, const double skin) {
+  double hi;
+  return touch_since(a, b, skin, &hi);
+}
+
+static struct body entity_body(const struct hshg_entity* const entity) {
+  return (struct body){
+    .x = entity->x,
+    .y = entity->y,
+    .w = entity->w,
+    .h = entity->h,
+    .vx = entity->vx,
+    .vy = entity->vy,
+    .swept = entity->grid == hshg_grid_giant
+  };
+}
+
+/* Rounding of the sweep in floats */
+#define SLACK (0.01 * UNIT)
+#else
+#define SLACK 0
+
+/* Whether two entities, widened together by skin, overlap */
+static int touch(const struct body* const a, const struct body* const b, const hshg_pos_t skin) {
+  return pos_abs(a->x - b->x) <= a->w + b->w + skin && pos_abs(a->y - b->y) <= a->h + b->h + skin;
+}
+#endif
+
+static int in_rect(const struct body* const a, const hshg_pos_t x1, const hshg_pos_t y1, const hshg_pos_t x2, const hshg_pos_t y2) {
+  return a->x + a->w >= x1 && a->x - a->w <= x2 && a->y + a->h >= y1 && a->y - a->h <= y2;
+}
+
+static int pair_cmp(const void* a, const void* b) {
+  const uint64_t x = *(const uint64_t*) a;
+  const uint64_t y = *(const uint64_t*) b;
+  return x < y ? -1 : x > y;
+}
+
+void update(struct hshg* hshg, hshg_entity_t idx) {
+  struct hshg_entity* const entity = hshg->entities + idx;
+  entity->x += bodies[entity->ref].vx;
+  entity->y += bodies[entity->ref].vy;
+  hshg_move(hshg, idx);
+}
+
+static void add_pair(uint64_t min, uint64_t max) {
+  if(min > max) {
+    const uint64_t temp = min;
+    min = max;
+    max = temp;
+  }
+#if THREADS > 0
+  pthread_mutex_lock(&pairs_mutex);
+#endif
+  if(pairs_len == pairs_size) {
+    pairs_size = pairs_size != 0 ? pairs_size << 1 : 1024;
+    pairs = realloc(pairs, sizeof(*pairs) * pairs_size);
+    assert(pairs);
+  }
+  pairs[pairs_len++] = (min << 32) | max;
+#if THREADS > 0
+  pthread_mutex_unlock(&pairs_mutex);
+#endif
+}
+
+void collide(const struct hshg* hshg, const struct hshg_entity* a, const struct hshg_entity* b) {
+  (void) hshg;
+#if CCD == 1
+  /* Swept pairs start to overlap toi of the way into the frame, as far as
+  rounding over the distance they sweep allows */
+  const struct body ba = entity_body(a);
+  const struct body bb = entity_body(b);
+  double hi;
+  assert(hshg->toi >= 0 && hshg->toi <= 1);
+  if((ba.swept || bb.swept) && touch_since(&ba, &bb, hshg->skin, &hi)) {
+    const double vx = fabs((ba.swept ? ba.vx : 0) - (double)(bb.swept ? bb.vx : 0));
+    const double vy = fabs((ba.swept ? ba.vy : 0) - (double)(bb.swept ? bb.vy : 0));
+    const double v = vx == 0 ? vy : vy == 0 ? vx : fmin(vx, vy);
+    assert(v == 0 || fabs(hshg->toi - (1 - hi)) <= 1e-4 + SLACK / v);
+  } else if(!ba.swept && !bb.swept) {
+    assert(hshg->toi == 1);
+  }
+#endif
+  add_pair(a->ref, b->ref);
+}
+
+void query(const struct hshg* hshg, const struct hshg_entity* a) {
+  (void) hshg;
+  ++hits[a->ref];
+}
+
+void query_with(const struct hshg* hshg, const struct hshg_entity* a, void* data) {
+  (void) hshg;
+  ++((uint32_t*) data)[a->ref];
+}
+
+#if RESPOND == 1
+/* Checks hshg_respond() over two ranges of pairs and hshg_apply() against
+the response of every pair along its unit normal. Velocities are put back
+after, since summed up responses in the crowded spot only keep growing. */
+static void respond(struct hshg* const hshg) {
+  const hshg_entity_t used = hshg->entities_used;
+  hshg_pos_t* const deltas = calloc((uint64_t) used << 2, sizeof(*deltas));
+  double* const expected = calloc((uint64_t) used << 1, sizeof(*expected));
+  double* const error = calloc((uint64_t) used << 1, sizeof(*error));
+  assert(deltas && expected && error);
+  for(uint32_t i = 0; i < hshg->pairs_len; ++i) {
+    const struct hshg_entity* const a = hshg->entities + hshg->pairs[i].a;
+    const struct hshg_entity* const b = hshg->entities + hshg->pairs[i].b;
+    const double dx = (double) a->x - b->x;
+    const double dy = (double) a->y - b->y;
+    const double d = sqrt(dx * dx + dy * dy);
+    if(d == 0 || d > (double) a->w + b->w) continue;
+    const double nx = dx / d;
+    const double ny = dy / d;
+    const double j = ((double) b->vx - a->vx) * nx + ((double) b->vy - a->vy) * ny;
+    if(j <= 0) continue;
+    /* Rounding in floats, or truncating division in fixed point */
+#ifdef HSHG_FIXED
+    const double slack = 1;
+#else
+    const double slack = 1e-4 * (1 + j);
+#endif
+    const uint64_t ia = (uint64_t) hshg->pairs[i].a << 1;
+    const uint64_t ib = (uint64_t) hshg->pairs[i].b << 1;
+    expected[ia] += j * nx;
+    expected[ia + 1] += j * ny;
+    expected[ib] -= j * nx;
+    expected[ib + 1] -= j * ny;
+    error[ia] += slack;
+    error[ia + 1] += slack;
+    error[ib] += slack;
+    error[ib + 1] += slack;
+  }
+  const uint32_t half = hshg->pairs_len >> 1;
+  hshg_respond(hshg, 0, half, deltas);
+  hshg_respond(hshg, half, hshg->pairs_len, deltas + ((uint64_t) used << 1));
+  for(hshg_entity_t i = 1; i < used; ++i) {
+    const struct hshg_entity* const entity = hshg->entities + i;
+    if(entity->cell == hshg_cell_sq_max) continue;
+    const uint64_t k = (uint64_t) i << 1;
+    assert(fabs((double) deltas[k] + deltas[(uint64_t) used * 2 + k] - expected[k]) <= error[k] + 1e-6);
+    assert(fabs((double) deltas[k + 1] + deltas[(uint64_t) used * 2 + k + 1] - expected[k + 1]) <= error[k + 1] + 1e-6);
+  }
+  hshg_apply(hshg, deltas);
+  hshg_apply(hshg, deltas + ((uint64_t) used << 1));
+  for(hshg_entity_t i = 1; i < used; ++i) {
+    struct hshg_entity* const entity = hshg->entities + i;
+    if(entity->cell == hshg_cell_sq_max) continue;
+    const struct body* const body = bodies + entity->ref;
+    const uint64_t k = (uint64_t) i << 1;
+    assert(entity->vx == (hshg_pos_t)(body->vx + deltas[k]) + deltas[(uint64_t) used * 2 + k]);
+    assert(entity->vy == (hshg_pos_t)(body->vy + deltas[k + 1]) + deltas[(uint64_t) used * 2 + k + 1]);
+    entity->vx = body->vx;
+    entity->vy = body->vy;
+  }
+  free(deltas);
+  free(expected);
+  free(error);
+}
+#endif
+
+#if SHARED > 0
+struct hshg_shared shared;
+uint8_t readers_stop;
+uint32_t reads;
+
+/* rand() isn't meant for threads */
+static hshg_pos_t rnd_with(uint32_t* const seed, const float min, const float max) {
+  *seed = *seed * 1103515245 + 12345;
+  return (hshg_pos_t)((min + (max - min) * ((float)(*seed >> 8) / (1 << 24))) * UNIT);
+}
+
+static void* reader(void* data) {
+  uint32_t seed = (uintptr_t) data;
+  uint32_t* const found = calloc(ENTITIES_NUM, sizeof(*found));
+  assert(found);
+  while(!__atomic_load_n(&readers_stop, __ATOMIC_ACQUIRE)) {
+    const struct hshg* const shot = hshg_acquire(&shared);
+    if(shot == NULL) continue;
+    const hshg_pos_t x1 = rnd_with(&seed, -4000, 4000) + ORIGIN;
+    const hshg_pos_t y1 = rnd_with(&seed, -4000, 4000) + ORIGIN;
+    const hshg_pos_t x2 = x1 + rnd_with(&seed, 10, 3000);
+    const hshg_pos_t y2 = y1 + rnd_with(&seed, 10, 3000);
+    memset(found, 0, sizeof(*found) * ENTITIES_NUM);
+    hshg_query_with(shot, x1, y1, x2, y2, query_with, found);
+    uint32_t expected = 0;
+    for(hshg_entity_t i = 1; i < shot->entities_used; ++i) {
+      const struct hshg_entity* const entity = shot->entities + i;
+      if(entity->cell == hshg_cell_sq_max) continue;
+      const struct body body = { .x = entity->x, .y = entity->y, .w = entity->w, .h = entity->h };
+      const int in = in_rect(&body, x1, y1, x2, y2);
+      assert(found[entity->ref] == (uint32_t) in);
+      expected += in;
+    }
+    for(uint32_t i = 0; i < ENTITIES_NUM; ++i) {
+      expected -= found[i];
+    }
+    assert(expected == 0);
+    hshg_release(&shared, shot);
+    __atomic_add_fetch(&reads, 1, __ATOMIC_RELAXED);
+  }
+  free(found);
+  return NULL;
+}
+#endif
+
+static struct hshg_entity body_entity(const uint32_t ref) {
+  const struct body* const body = bodies + ref;
+  return (struct hshg_entity){
+    .x = body->x,
+    .y = body->y,
+    .w = body->w,
+    .h = body->h,
+#ifdef HSHG_VELOCITY
+    .vx = body->vx,
+    .vy = body->vy,
+#endif
+    .ref = ref
+  };
+}
+
+static void insert(struct hshg* const hshg, const uint32_t ref) {
+  const struct hshg_entity entity = body_entity(ref);
+  hshg_insert(hshg, &entity);
+}
+
+#if STAGE > 0
+struct hshg_stage stages[STAGE];
+hshg_entity_t removes[ENTITIES_NUM];
+hshg_entity_t removes_len;
+
+static void* stager(void* data) {
+  const uint32_t t = (uintptr_t) data;
+  struct hshg_stage* const stage = stages + t;
+  for(hshg_entity_t i = 0; i < removes_len; ++i) {
+    if(i % STAGE == t || (i + 1) % STAGE == t) {
+      hshg_stage_remove(stage, removes[i]);
+    }
+  }
+  for(uint32_t i = 3; i < ENTITIES_NUM; i += 14) {
+    if(i / 14 % STAGE == t) {
+      const struct hshg_entity entity = body_entity(i);
+      hshg_stage_insert(stage, &entity);
+    }
+  }
+  return NULL;
+}
+
+static void stage_all(struct hshg* const hshg) {
+  pthread_t stagers[STAGE];
+  for(uintptr_t i = 0; i < STAGE; ++i) {
+    assert(!pthread_create(stagers + i, NULL, stager, (void*) i));
+  }
+  for(uint32_t i = 0; i < STAGE; ++i) {
+    assert(!pthread_join(stagers[i], NULL));
+  }
+  hshg_commit(hshg, stages, STAGE);
+  for(uint32_t i = 0; i < STAGE; ++i) {
+    assert(stages[i].removes_len == 0 && stages[i].inserts_len == 0);
+  }
+  removes_len = 0;
+}
+#endif
+
 int main() {
+  srand(SEED);
   struct hshg hshg = {0};
+  hshg.update = update;
+#if RESPOND == 1
+  hshg.collide = NULL;
+#else
+  hshg.collide = collide;
+#endif
+  hshg.query = query;
+  hshg.rebuild = REBUILD;
+  hshg.loose = LOOSE;
+  hshg.skin = SKIN * UNIT;
+  hshg.crowded = CROWDED;
+  hshg.quantize = QUANTIZE;
+#if CCD == 1
+  hshg.ccd = 1;
+#endif
+  assert(!hshg_init(&hshg, CELLS_SIDE, CELL_SIZE));
+#if THREADS > 0
+  struct hshg_pool pool;
+  assert(!hshg_pool_init(&pool, THREADS));
+#endif
+#if SHARED > 0
+  pthread_t readers[SHARED];
+  for(uintptr_t i = 0; i < SHARED; ++i) {
+    assert(!pthread_create(readers + i, NULL, reader, (void*)(i + 1)));
+  }
+#endif
+
+  for(uint32_t i = 0; i < ENTITIES_NUM; ++i) {
+    struct body* const body = bodies + i;
+    body->w = rnd(1, 8);
+    if(i % 50 == 0) {
+      body->w = rnd(8, 200);
+    }
+    if(i % GIANTS == 0) {
+      body->w = rnd(500, 3000);
+    }
+    body->h = body->w;
+    if(i % 3 == 0) {
+      if(i % 2) {
+        body->h = body->w / 16 + 1;
+      } else {
+        body->w = body->h / 16 + 1;
+      }
+    }
+    if(i % 10 == 1) {
+      body->x = rnd_at(100, 120);
+      body->y = rnd_at(100, 120);
+      body->w = body->h = rnd(1, 3);
+    } else {
+      body->x = rnd_at(-3000, 3000);
+      body->y = rnd_at(-3000, 3000);
+    }
+    body->vx = rnd(-20, 20);
+    body->vy = rnd(-20, 20);
+    body->alive = 1;
+    insert(&hshg, i);
+  }
+
+  uint64_t total = 0;
+  uint64_t queried = 0;
+#if SNAPSHOT == 1
+  struct hshg shot = {0};
+#endif
+  for(int f = 0; f < FRAMES; ++f) {
+    if(f != 0 && !SNAPSHOT) {
+#if INTEGRATE == 1
+      hshg_integrate(&hshg, wall_x1, wall_x1, wall_x2, wall_x2);
+      for(hshg_entity_t i = 1; i < hshg.entities_used; ++i) {
+        const struct hshg_entity* const entity = hshg.entities + i;
+        if(entity->cell == hshg_cell_sq_max) continue;
+        struct body* const body = bodies + entity->ref;
+        bounce(&body->x, &body->vx, body->w);
+        bounce(&body->y, &body->vy, body->h);
+        assert(entity->x == body->x && entity->y == body->y);
+        assert(entity->vx == body->vx && entity->vy == body->vy);
+      }
+#else
+      hshg_update(&hshg);
+#endif
+    }
+    if(f == 3) {
+      for(hshg_entity_t i = 1; i < hshg.entities_used; ++i) {
+        if(hshg.entities[i].cell == hshg_cell_sq_max || hshg.entities[i].ref % 7 != 3) continue;
+        bodies[hshg.entities[i].ref].alive = 0;
+#if STAGE > 0
+        removes[removes_len++] = i;
+#else
+        hshg_remove(&hshg, i);
+#endif
+      }
+      for(uint32_t i = 3; i < ENTITIES_NUM; i += 14) {
+        bodies[i].x = rnd_at(-3000, 3000);
+        bodies[i].y = rnd_at(-3000, 3000);
+        bodies[i].alive = 1;
+#if STAGE == 0
+        insert(&hshg, i);
+#endif
+      }
+#if STAGE > 0
+      stage_all(&hshg);
+#endif
+    }
+    /* hshg_optimize() can't skip removed entities */
+#if OPTIMIZE == 1 && REBUILD == 0
+    if(f < 3) {
+      hshg_optimize(&hshg);
+    }
+#endif
+    for(hshg_entity_t i = 1; i < hshg.entities_used; ++i) {
+      const struct hshg_entity* const entity = hshg.entities + i;
+      if(entity->cell == hshg_cell_sq_max) continue;
+      bodies[entity->ref].x = entity->x;
+      bodies[entity->ref].y = entity->y;
+      bodies[entity->ref].swept = entity->grid == hshg_grid_giant;
+    }
+#if SHARED > 0
+    /* Fails only while the other snapshots are being read */
+    while(hshg_publish(&shared, &hshg));
+#endif
+#if SNAPSHOT == 1
+    hshg_snapshot(&shot, &hshg);
+    struct hshg* const target = &shot;
+    hshg_update(&hshg);
+#else
+    struct hshg* const target = &hshg;
+#endif
 
-  
+    pairs_len = 0;
+#if THREADS > 0
+    hshg_collide_parallel(target, &pool);
+#elif STEP >= 0
+    struct hshg_cursor cursor = {0};
+    while(!hshg_collide_step(target, STEP, &cursor));
+#else
+    hshg_collide(target);
+#endif
+#if RESPOND == 1
+    for(uint32_t i = 0; i < target->pairs_len; ++i) {
+      add_pair(target->entities[target->pairs[i].a].ref, target->entities[target->pairs[i].b].ref);
+    }
+#endif
+    qsort(pairs, pairs_len, sizeof(*pairs), pair_cmp);
+    total += pairs_len;
+    /* Kept pairs are only checked again once an entity moved by skin / 2 */
+    for(uint64_t i = 0; i < pairs_len; ++i) {
+      assert(i == 0 || pairs[i] != pairs[i - 1]);
+      const struct body* const a = bodies + (pairs[i] >> 32);
+      const struct body* const b = bodies + (uint32_t) pairs[i];
+      assert(a->alive && b->alive);
+      assert(touch(a, b, target->skin * 2 + SLACK));
+    }
+    for(uint32_t a = 0; a < ENTITIES_NUM; ++a) {
+      if(!bodies[a].alive) continue;
+      for(uint32_t b = a + 1; b < ENTITIES_NUM; ++b) {
+        if(!bodies[b].alive || !touch(bodies + a, bodies + b, -SLACK)) continue;
+        const uint64_t pair = ((uint64_t) a << 32) | b;
+        assert(bsearch(&pair, pairs, pairs_len, sizeof(*pairs), pair_cmp));
+      }
+    }
 
+    /* Small queries, and ones covering most of the plane */
+    for(int q = 0; q < 12; ++q) {
+      const hshg_pos_t x1 = rnd_at(-4000, 4000);
+      const hshg_pos_t y1 = rnd_at(-4000, 4000);
+      const hshg_pos_t x2 = x1 + (q < 6 ? rnd(10, 600) : rnd(600, 9000));
+      const hshg_pos_t y2 = y1 + (q < 6 ? rnd(10, 600) : rnd(600, 9000));
+      memset(hits, 0, sizeof(hits));
+      if(q % 2) {
+        hshg_query_with(target, x1, y1, x2, y2, query_with, hits);
+      } else {
+        hshg_query(target, x1, y1, x2, y2);
+      }
+      for(uint32_t i = 0; i < ENTITIES_NUM; ++i) {
+        assert(hits[i] == (bodies[i].alive && in_rect(bodies + i, x1, y1, x2, y2)));
+        queried += hits[i];
+      }
+    }
+#if RESPOND == 1
+    respond(target);
+#endif
+  }
+  printf("%lu pairs and %lu queried entities over %d frames match brute force\n", total, queried, FRAMES);
+
+#if THREADS > 0
+  hshg_pool_free(&pool);
+#endif
+#if STAGE > 0
+  for(uint32_t i = 0; i < STAGE; ++i) {
+    hshg_stage_free(stages + i);
+  }
+#endif
+#if SHARED > 0
+  while(__atomic_load_n(&reads, __ATOMIC_RELAXED) == 0);
+  __atomic_store_n(&readers_stop, 1, __ATOMIC_RELEASE);
+  for(uint32_t i = 0; i < SHARED; ++i) {
+    assert(!pthread_join(readers[i], NULL));
+  }
+  printf("%u queries by %d readers match their snapshots\n", reads, SHARED);
+  hshg_shared_free(&shared);
+#endif
+#if SNAPSHOT == 1
+  hshg_free(&shot);
+#endif
+  hshg_free(&hshg);
+  free(pairs);
   return 0;
-}
\ No newline at end of file
+}
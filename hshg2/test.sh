@@ -0,0 +1,8 @@
+#!/bin/bash
+
+# Runs test.c in every mode. Extra arguments go to the compiler.
+for mode in "" "-DOPTIMIZE=1" "-DREBUILD=1" "-DLOOSE=0.25" "-DSKIN=4" "-DSKIN=48 -DOPTIMIZE=1" "-DQUANTIZE=1 -DOPTIMIZE=1" "-DQUANTIZE=1 -DOPTIMIZE=1 -DUNIT=16 -DCELL_SIZE=24576 -DCELLS_SIDE=4 -DGIANTS=20" "-DCROWDED=4" "-DSTEP=0" "-DHSHG_THREADS -DTHREADS=4" "-DHSHG_MORTON" "-DHSHG_FIXED" "-DHSHG_FIXED -DREBUILD=1 -DSKIN=4 -DQUANTIZE=1" "-DHSHG_FIXED -DCELL_SIZE=1048576 -DORIGIN=-1069547520" "-DHSHG_VELOCITY -DINTEGRATE=1" "-DHSHG_VELOCITY -DINTEGRATE=1 -DSKIN=4" "-DHSHG_VELOCITY -DINTEGRATE=1 -DREBUILD=1" "-DHSHG_FIXED -DHSHG_VELOCITY -DINTEGRATE=1" "-DHSHG_VELOCITY -DCCD=1" "-DHSHG_VELOCITY -DCCD=1 -DREBUILD=1 -DINTEGRATE=1" "-DHSHG_FIXED -DHSHG_VELOCITY -DCCD=1" "-DHSHG_VELOCITY -DRESPOND=1" "-DHSHG_VELOCITY -DRESPOND=1 -DSKIN=4 -DINTEGRATE=1" "-DHSHG_FIXED -DHSHG_VELOCITY -DRESPOND=1" "-DSNAPSHOT=1" "-DSNAPSHOT=1 -DOPTIMIZE=1 -DQUANTIZE=1" "-DSNAPSHOT=1 -DREBUILD=1 -DSKIN=4" "-DSNAPSHOT=1 -DHSHG_THREADS -DTHREADS=4" "-DHSHG_FIXED -DHSHG_VELOCITY -DSNAPSHOT=1 -DRESPOND=1" "-DSHARED=4 -fsanitize=thread" "-DSHARED=2 -DHSHG_FIXED -DOPTIMIZE=1 -fsanitize=thread" "-DSTAGE=4 -fsanitize=thread" "-DSTAGE=3 -DSHARED=2 -DHSHG_VELOCITY -DINTEGRATE=1 -fsanitize=thread"; do
+  echo "${mode:-plain}"
+  cc hshg.c test.c -o hshg_check -O2 $mode "$@" -lshnet -lm -lpthread && ./hshg_check || exit 1
+done
+rm -f hshg_check